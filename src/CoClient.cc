@@ -28,15 +28,26 @@
 
 #include "CoClient.h"
 
+#include "CoClientUtil.h"
+#include "CoConnection.h"
 #include "miMessage.h"
-#include "miMessageIO.h"
 #include "QLetterCommands.h"
 
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
+#include <QtCore/QFile>
 #include <QtCore/QFileInfo>
+#include <QtCore/QFileSystemWatcher>
+#include <QtCore/QLockFile>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
 #include <QtCore/QProcess>
 #include <QtCore/QSettings>
+#include <QtCore/QStandardPaths>
 #include <QtCore/QStringList>
+#include <QtCore/QThread>
+#include <QtCore/QUuid>
 #include <QtCore/QTimer>
 
 #include <QtNetwork/QHostInfo>
@@ -54,7 +65,9 @@
 #include <pwd.h>
 #endif
 
+#include <algorithm>
 #include <fstream>
+#include <random>
 #include <sstream>
 #include <unistd.h>
 
@@ -99,7 +112,33 @@ const QString CLIENT_INI = "client.ini";
 const QString KEY_SERVER_COMMAND = "client/server_command";
 const QString KEY_ATTEMPT_START = "client/attempt_to_start_server";
 const QString KEY_USER_ID = "client/user_id";
-const int TIMEOUT_RECONNECT_MS = 1000;
+const QString KEY_RECONNECT_FIRST = "client/reconnect_first_ms";
+const QString KEY_RECONNECT_INITIAL = "client/reconnect_initial_ms";
+const QString KEY_RECONNECT_MAX = "client/reconnect_max_ms";
+const QString KEY_RECONNECT_FACTOR = "client/reconnect_factor";
+const QString KEY_RECONNECT_JITTER = "client/reconnect_jitter";
+const int RECONNECT_FIRST_MS = 100;
+const int RECONNECT_INITIAL_MS = 1000;
+const int RECONNECT_MAX_MS = 60000;
+const double RECONNECT_FACTOR = 2;
+const double RECONNECT_JITTER = 0.5;
+// how long to wait for a server started by this or another client
+const int SERVER_START_TIMEOUT_MS = 10000;
+const int SERVER_POLL_MS = 50;
+const QString KEY_CONNECT_STAGGER = "client/connect_stagger_ms";
+const QString KEY_SERVER_PLACEMENT = "client/server_placement";
+const int RING_REPLICAS = 100;
+const QString DOT_COSERVER = ".coserver";
+const QString LAST_SERVER_FILE = "last_server";
+// pings older than this many intervals are not matched with a PONG anymore
+const int PINGS_KEPT = 8;
+// sequence numbers remembered per origin for dropping duplicates
+const size_t SEEN_KEPT = 1024;
+const int STANDBY_RETRY_MS = 5000;
+const qint64 SEND_QUEUE_HIGH_BYTES = 1024*1024;
+const qint64 SEND_QUEUE_LOW_BYTES = 256*1024;
+// bound waiting for scheduled messages, in case clocks are far apart
+const qint64 SCHEDULE_MAX_DELAY_MS = 10000;
 
 QString joinArgs(const QStringList& args)
 {
@@ -121,12 +160,106 @@ QString joinArgs(const QStringList& args)
     return joined;
 }
 
-QVariant value(QSettings& settings1, QSettings& settings2, const QString& key, const QVariant& fallback=QVariant())
+qint64 estimatedSize(const QString& s)
 {
-    if (settings1.contains(key))
-        return settings1.value(key).toString();
-    else
-        return settings2.value(key, fallback).toString();
+    return sizeof(quint32) + 2*s.size(); // length + utf16
+}
+
+qint64 estimatedSize(const QStringList& l)
+{
+    qint64 size = sizeof(quint32);
+    for (int i=0; i<l.count(); ++i)
+        size += estimatedSize(l.at(i));
+    return size;
+}
+
+//! approximately the size of the protocol version 1 frame
+qint64 estimatedSize(const miQMessage& qmsg, const ClientIds& to)
+{
+    qint64 size = 4*sizeof(quint32); // length, magic, version, row count
+    size += sizeof(quint32) * (1 + to.size());
+    size += estimatedSize(qmsg.command());
+    size += estimatedSize(qmsg.getCommonDesc());
+    size += estimatedSize(qmsg.getCommonValues());
+    size += estimatedSize(qmsg.getDataDesc());
+    for (int r=0; r<qmsg.countDataRows(); ++r)
+        size += estimatedSize(qmsg.getDataValues(r));
+    return size;
+}
+
+//! qmsg without the fields added for hot standby, for sending it again
+miQMessage unstamped(const miQMessage& qmsg)
+{
+    if (qmsg.findCommonDesc(qmstrings::origin) < 0)
+        return qmsg;
+    QStringList desc, values;
+    for (int i = 0; i < qmsg.countCommon(); ++i) {
+        if (qmsg.getCommonDesc(i) != qmstrings::origin && qmsg.getCommonDesc(i) != qmstrings::origin_seq) {
+            desc << qmsg.getCommonDesc(i);
+            values << qmsg.getCommonValue(i);
+        }
+    }
+    miQMessage copy(qmsg);
+    copy.setCommon(desc, values);
+    return copy;
+}
+
+//! queue messages on connection, which may live on the I/O thread
+void sendThrough(CoConnection* connection, const CoConnection::Messages& messages)
+{
+    qint64 bytes = 0;
+    for (CoConnection::Messages::const_iterator it = messages.begin(); it != messages.end(); ++it)
+        bytes += estimatedSize(it->qmsg, it->to);
+    connection->addInTransit(bytes);
+    QMetaObject::invokeMethod(connection, "send",
+            Q_ARG(CoConnection::Messages, messages), Q_ARG(qint64, bytes));
+}
+
+const QChar KEY_SEPARATOR = QChar(0x1f); // ASCII unit separator
+
+QString conflationKey(const miQMessage& qmsg, const QString& commonField)
+{
+    QString key = qmsg.command();
+    if (!commonField.isEmpty())
+        key += KEY_SEPARATOR + qmsg.getCommonValue(commonField);
+    return key;
+}
+
+QString receiversKey(const ClientIds& to)
+{
+    QString key;
+    for (ClientIds::const_iterator it = to.begin(); it != to.end(); ++it)
+        key += KEY_SEPARATOR + QString::number(*it);
+    return key;
+}
+
+//! remove the origins used by client id, and return them
+QStringList eraseOrigins(std::map<QString, int>& origins, int id)
+{
+    QStringList erased;
+    for (std::map<QString, int>::iterator it = origins.begin(); it != origins.end();) {
+        if (it->second == id) {
+            erased << it->first;
+            origins.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    return erased;
+}
+
+//! identifies a request to a peer, ignoring its request id
+QString requestKey(int toId, const miQMessage& qmsg)
+{
+    QString key = QString::number(toId) + KEY_SEPARATOR + qmsg.command();
+    for (int i = 0; i < qmsg.countCommon(); ++i) {
+        if (qmsg.getCommonDesc(i) != qmstrings::request_id)
+            key += KEY_SEPARATOR + qmsg.getCommonDesc(i) + '=' + qmsg.getCommonValue(i);
+    }
+    key += KEY_SEPARATOR + qmsg.getDataDesc().join(",");
+    for (int r = 0; r < qmsg.countDataRows(); ++r)
+        key += KEY_SEPARATOR + qmsg.getDataValues(r).join(",");
+    return key;
 }
 
 QUrl serverUrlFromHostname(const QString& h="", quint16 port=0)
@@ -145,14 +278,28 @@ QUrl serverUrlFromHostname(const QString& h="", quint16 port=0)
     return serverUrl;
 }
 
-void addServerUrlsFromIniFile(CoClient::QUrlList& urls, const QString& path)
+typedef std::map<QString, QString> settings_t;
+
+settings_t readSettings(const QString& path)
 {
-    METLIBS_LOG_SCOPE("trying to read servers from file '" << path << "'");
+    METLIBS_LOG_SCOPE("reading settings from file '" << path << "'");
+    settings_t values;
+    if (path.isEmpty())
+        return values;
     QSettings settings(path, QSettings::IniFormat);
+    const QStringList keys = settings.allKeys();
+    for (int i=0; i<keys.size(); ++i)
+        values[keys.at(i)] = settings.value(keys.at(i)).toString();
+    return values;
+}
+
+void addServerUrlsFromSettings(CoClient::QUrlList& urls, const settings_t& settings)
+{
     for (int i=0; true; ++i) {
         const QString key = QString("servers/server_%1").arg(i);
-        if (settings.contains(key)) {
-            const QString u = settings.value(key).toString().trimmed();
+        settings_t::const_iterator it = settings.find(key);
+        if (it != settings.end()) {
+            const QString u = it->second.trimmed();
             METLIBS_LOG_DEBUG("adding server url '" << u << "' from key '" << key << "'");
             urls << QUrl(u);
         } else if (i > 16) {
@@ -188,10 +335,35 @@ CoClient::QUrlList serverUrlsFromEnviroment()
 QString userClientIni()
 {
     QDir dot_coserver = QDir::home();
-    dot_coserver.cd(".coserver");
+    dot_coserver.cd(DOT_COSERVER);
     return QFileInfo(dot_coserver, CLIENT_INI).filePath();
 }
 
+QString lastServerFile()
+{
+    // not next to userClientIni(), which falls back to $HOME
+    return QDir::home().filePath(DOT_COSERVER + "/" + LAST_SERVER_FILE);
+}
+
+QUrl loadLastServer()
+{
+    QFile file(lastServerFile());
+    if (!file.open(QIODevice::ReadOnly))
+        return QUrl();
+    return QUrl(QString::fromUtf8(file.readLine()).trimmed());
+}
+
+void saveLastServer(const QUrl& url)
+{
+    if (loadLastServer() == url)
+        return;
+    const QFileInfo fi(lastServerFile());
+    QDir().mkpath(fi.absolutePath());
+    QFile file(fi.filePath());
+    if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        file.write(url.toString(QUrl::RemovePassword).toUtf8() + "\n");
+}
+
 QString systemClientIni()
 {
 #if defined(PKGCONFDIR)
@@ -202,14 +374,182 @@ QString systemClientIni()
 #endif // !PKGCONFDIR
 }
 
+/*! Per-user directory for the server start lock. In a shared directory,
+ *  another user's lock would block starting a server, and could not be
+ *  removed when stale.
+ */
+QString serverStartLockDir()
+{
+    const QString runtime = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+    if (!runtime.isEmpty())
+        return runtime;
+    const QString dot = QDir::home().filePath(DOT_COSERVER);
+    QDir().mkpath(dot);
+    return dot;
+}
+
+//! directories containing the user's and the system client.ini, if they exist
+QStringList configDirs()
+{
+    QStringList dirs;
+    const QDir user(QDir::home().filePath(DOT_COSERVER));
+    if (user.exists())
+        dirs << user.path();
+#if defined(PKGCONFDIR)
+    const QDir system(PKGCONFDIR);
+    if (system.exists())
+        dirs << system.path();
+#endif // PKGCONFDIR
+    return dirs;
+}
+
+//! modification time of an ini file, null if it does not exist
+QDateTime iniModified(const QString& path)
+{
+    const QFileInfo fi(path);
+    return fi.exists() ? fi.lastModified() : QDateTime();
+}
+
+//! Contents of the user's and the system client.ini.
+struct ClientSettings {
+    settings_t user;
+    settings_t system;
+
+    //! value from the user's client.ini, or else from the system client.ini
+    QVariant value(const QString& key, const QVariant& fallback=QVariant()) const
+    {
+        settings_t::const_iterator it = user.find(key);
+        if (it != user.end())
+            return it->second;
+        it = system.find(key);
+        if (it != system.end())
+            return it->second;
+        return fallback.toString();
+    }
+};
+
+typedef std::shared_ptr<const ClientSettings> ClientSettings_cp;
+
+/*! Settings and identity shared by all CoClient objects in the process.
+ *
+ * The ini files are read once, and read again after a change has been
+ * noticed by a file system watcher. The user id and host name are
+ * looked up only once, as this may be slow with network user databases.
+ */
+class ClientConfig
+{
+public:
+    static ClientConfig& instance();
+
+    ClientSettings_cp settings();
+    QString userId();
+    QString localHostName();
+
+private:
+    ClientConfig() { }
+    void watch();
+    void changed(bool fileChanged);
+
+private:
+    QMutex mMutex;
+    ClientSettings_cp mSettings;
+    QDateTime mModified[2]; //!< of the user's and the system client.ini when read
+    QString mUserId;
+    QString mLocalHostName;
+    QPointer<QFileSystemWatcher> mWatcher; //!< lives as long as the process
+};
+
+ClientConfig& ClientConfig::instance()
+{
+    static ClientConfig config;
+    return config;
+}
+
+ClientSettings_cp ClientConfig::settings()
+{
+    QMutexLocker lock(&mMutex);
+    if (!mWatcher)
+        watch();
+    if (!mSettings) {
+        std::shared_ptr<ClientSettings> s = std::make_shared<ClientSettings>();
+        // before reading, so that a change while reading is noticed
+        mModified[0] = iniModified(userClientIni());
+        mModified[1] = iniModified(systemClientIni());
+        s->user = readSettings(userClientIni());
+        s->system = readSettings(systemClientIni());
+        mSettings = s;
+    }
+    return mSettings;
+}
+
+QString ClientConfig::userId()
+{
+    QMutexLocker lock(&mMutex);
+    if (mUserId.isEmpty())
+        mUserId = getUserId();
+    return mUserId;
+}
+
+QString ClientConfig::localHostName()
+{
+    QMutexLocker lock(&mMutex);
+    if (mLocalHostName.isEmpty())
+        mLocalHostName = QHostInfo::localHostName();
+    return mLocalHostName;
+}
+
+void ClientConfig::watch()
+{
+    // without an event loop, there are no change notifications
+    QCoreApplication* app = QCoreApplication::instance();
+    if (!app)
+        return;
+    mWatcher = new QFileSystemWatcher;
+    const QString files[2] = { userClientIni(), systemClientIni() };
+    for (int i=0; i<2; ++i) {
+        if (!files[i].isEmpty() && QFileInfo(files[i]).exists())
+            mWatcher->addPath(files[i]);
+    }
+    // directories are watched, too, as editors often replace files; not
+    // $HOME, where userClientIni() points if ~/.coserver is missing
+    const QStringList dirs = configDirs();
+    if (!dirs.isEmpty())
+        mWatcher->addPaths(dirs);
+    QObject::connect(mWatcher.data(), &QFileSystemWatcher::fileChanged, [this]() { changed(true); });
+    QObject::connect(mWatcher.data(), &QFileSystemWatcher::directoryChanged, [this]() { changed(false); });
+    mWatcher->moveToThread(app->thread());
+}
+
+void ClientConfig::changed(bool fileChanged)
+{
+    // called in the watcher's thread
+    METLIBS_LOG_SCOPE();
+    QMutexLocker lock(&mMutex);
+
+    const QString files[2] = { userClientIni(), systemClientIni() };
+    bool iniChanged = fileChanged;
+    for (int i=0; i<2; ++i) {
+        if (files[i].isEmpty())
+            continue;
+        // other files in the directories change, too, e.g. last_server
+        if (iniModified(files[i]) != mModified[i])
+            iniChanged = true;
+        // a replaced file is no longer watched
+        if (QFileInfo(files[i]).exists() && !mWatcher->files().contains(files[i]))
+            mWatcher->addPath(files[i]);
+    }
+    if (iniChanged)
+        mSettings.reset();
+}
+
 CoClient::QUrlList defaultServerUrls()
 {
     CoClient::QUrlList urls = serverUrlsFromEnviroment();
     if (urls.isEmpty()) {
-        addServerUrlsFromIniFile(urls, userClientIni());
-    }
-    if (urls.isEmpty()) {
-        addServerUrlsFromIniFile(urls, systemClientIni());
+        const ClientSettings_cp ini = ClientConfig::instance().settings();
+        addServerUrlsFromSettings(urls, ini->user);
+        if (urls.isEmpty())
+            addServerUrlsFromSettings(urls, ini->system);
     }
     if (urls.isEmpty()) {
         urls << serverUrlFromHostname();
@@ -219,6 +559,74 @@ CoClient::QUrlList defaultServerUrls()
 
 } // namespace anonymous
 
+/*! Lock-free queue with many producers and one consumer, after the
+ *  intrusive MPSC queue by Dmitry Vyukov. Producers never wait; pop()
+ *  may return false while a producer is in the middle of push().
+ */
+class CoClient::PostedQueue
+{
+public:
+    PostedQueue()
+        : mHead(&mStub), mTail(&mStub) { }
+
+    ~PostedQueue()
+        { ClientIds to; miQMessage qmsg; while (pop(to, qmsg)) { } }
+
+    void push(const miQMessage& qmsg, const ClientIds& to)
+        { push(new Node(qmsg, to)); }
+
+    bool pop(ClientIds& to, miQMessage& qmsg);
+
+private:
+    struct Node {
+        std::atomic<Node*> next;
+        miQMessage qmsg;
+        ClientIds to;
+        Node() : next(0) { }
+        Node(const miQMessage& q, const ClientIds& t)
+            : next(0), qmsg(q), to(t) { }
+    };
+
+    void push(Node* node);
+
+private:
+    std::atomic<Node*> mHead; //!< last pushed, written by producers
+    Node* mTail;              //!< next to pop, only used by the consumer
+    Node mStub;
+};
+
+void CoClient::PostedQueue::push(Node* node)
+{
+    node->next.store(0, std::memory_order_relaxed);
+    Node* prev = mHead.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+bool CoClient::PostedQueue::pop(ClientIds& to, miQMessage& qmsg)
+{
+    Node* tail = mTail;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &mStub) {
+        if (!next)
+            return false;
+        mTail = tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (!next) {
+        if (tail != mHead.load(std::memory_order_acquire))
+            return false; // a producer has not finished push()
+        push(&mStub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+    }
+    mTail = next;
+    to = tail->to;
+    qmsg = tail->qmsg;
+    delete tail;
+    return true;
+}
+
 CoClient::CoClient(const QString& ct, QObject* parent)
     : QObject(parent)
 {
@@ -264,28 +672,123 @@ CoClient::CoClient(const QString& ct, const QList<QUrl>& urls, QObject* parent)
 CoClient::~CoClient()
 {
     METLIBS_LOG_SCOPE();
+    stopRace();
+    closeStandby();
+    if (mConnection) {
+        mConnection->disconnect(this);
+        mConnection->deleteLater();
+        mConnection = 0;
+    }
+    if (mIoThread) {
+        // deferred deletes are still processed when the thread finishes
+        mIoThread->quit();
+        mIoThread->wait();
+    }
 }
 
 void CoClient::initialize(const QString& ct)
 {
     METLIBS_LOG_SCOPE();
 
-    tcpSocket = 0;
-    localSocket = 0;
+    qRegisterMetaType<CoClient::ReceivedMessages>("CoClient::ReceivedMessages");
+    qRegisterMetaType<CoConnection::Messages>("CoConnection::Messages");
+    qRegisterMetaType<QAbstractSocket::SocketError>("QAbstractSocket::SocketError");
+    qRegisterMetaType<QLocalSocket::LocalSocketError>("QLocalSocket::LocalSocketError");
+
+    mConnection = 0;
+    mConnectionState = UNCONNECTED;
+    mUseIoThread = false;
+    mIoThread = 0;
+    mPosted.reset(new PostedQueue);
+    mPostedScheduled = false;
 
     mId = -1;
     name = clientType = ct;
 
-    QSettings userIni(userClientIni(), QSettings::IniFormat);
-    QSettings systemIni(systemClientIni(), QSettings::IniFormat);
-    serverCommand = value(userIni, systemIni, KEY_SERVER_COMMAND, "coserver4").toString();
-    mAttemptToStartServer = value(userIni, systemIni, KEY_ATTEMPT_START, true).toBool();
+    mSendQueueHigh = SEND_QUEUE_HIGH_BYTES;
+    mSendQueueLow = SEND_QUEUE_LOW_BYTES;
+    mSendQueueFull = false;
+    mFlushScheduled = false;
+    mOutgoingBytes = 0;
+    mOfflineMaxMessages = 0;
+    mOfflineMaxBytes = 0;
+    mPipelinedHandshake = false;
+    mClock.start();
+    mDroppedMessages = 0;
+    mReadBudgetMessages = 0;
+    mReadBudgetMicroseconds = 0;
+    mBatchedDelivery = false;
+
+    mScheduledDelivery = false;
+    mScheduleTimer = new QTimer(this);
+    mScheduleTimer->setSingleShot(true);
+    mScheduleTimer->setTimerType(Qt::PreciseTimer);
+    connect(mScheduleTimer, SIGNAL(timeout()), SLOT(deliverScheduled()));
+
+    mHasViewport = false;
+
+    mNextRequestId = 1;
+    mRequestTimer = new QTimer(this);
+    mRequestTimer->setSingleShot(true);
+    connect(mRequestTimer, SIGNAL(timeout()), SLOT(expireRequests()));
+    mDelivering = false;
+    mDeliverScheduled = false;
+    mReadBufferLimit = 0;
+    mCreditMessages = 0;
+    mCreditBytes = 0;
+    mConsumedMessages = 0;
+    mConsumedBytes = 0;
+
+    const ClientSettings_cp ini = ClientConfig::instance().settings();
+    serverCommand = ini->value(KEY_SERVER_COMMAND, "coserver4").toString();
+    mAttemptToStartServer = ini->value(KEY_ATTEMPT_START, true).toBool();
+    setReconnectBackoff(ini->value(KEY_RECONNECT_FIRST, RECONNECT_FIRST_MS).toInt(),
+            ini->value(KEY_RECONNECT_INITIAL, RECONNECT_INITIAL_MS).toInt(),
+            ini->value(KEY_RECONNECT_MAX, RECONNECT_MAX_MS).toInt(),
+            ini->value(KEY_RECONNECT_FACTOR, RECONNECT_FACTOR).toDouble(),
+            ini->value(KEY_RECONNECT_JITTER, RECONNECT_JITTER).toDouble());
+    mReconnectAttempts = 0;
+    mReconnectTimer = new QTimer(this);
+    mReconnectTimer->setSingleShot(true);
+    connect(mReconnectTimer, SIGNAL(timeout()), SLOT(connectServer()));
+    mServerWatcher = 0;
+    mServerWaitDeadline = 0;
+    serverIndex = -1;
+    mHashedPlacement = (ini->value(KEY_SERVER_PLACEMENT, "ordered").toString() == "hash");
+    mRaceStaggerMs = std::max(ini->value(KEY_CONNECT_STAGGER, 0).toInt(), 0);
+    mRaceFailed = false;
+    mSessionGraceMs = 0;
+    mSessionId = -1;
+    mSessionTimer = new QTimer(this);
+    mSessionTimer->setSingleShot(true);
+    connect(mSessionTimer, SIGNAL(timeout()), SLOT(sessionExpired()));
+    mHeartbeatMisses = 0;
+    mHeartbeatOutstanding = 0;
+    mHeartbeatSeq = 0;
+    mSmoothedRtt8 = -1;
+    mHeartbeatTimer = new QTimer(this);
+    connect(mHeartbeatTimer, SIGNAL(timeout()), SLOT(sendHeartbeat()));
+    mHotStandby = false;
+    mStandby = 0;
+    mStandbyIndex = -1;
+    mStandbyId = -1;
+    mStandbyConsumedMessages = 0;
+    mStandbyConsumedBytes = 0;
+    mStandbyTimer = new QTimer(this);
+    mStandbyTimer->setSingleShot(true);
+    connect(mStandbyTimer, SIGNAL(timeout()), SLOT(connectStandby()));
+    mOrigin = QUuid::createUuid().toString();
+    mOriginSeq = 0;
+    mDuplicates.reset(new coclient::DuplicateFilter(SEEN_KEPT));
+    mRaceTimer = new QTimer(this);
+    mRaceTimer->setSingleShot(true);
+    connect(mRaceTimer, SIGNAL(timeout()), SLOT(raceNext()));
 
     userid = safe_getenv("COSERVER_USER").trimmed();
     if (userid.isEmpty())
-        userid = userIni.value(KEY_USER_ID, "").toString();
+        userid = ini->user.count(KEY_USER_ID) ? ini->user.at(KEY_USER_ID) : QString();
     if (userid.isEmpty())
-        userid = getUserId();
+        userid = ClientConfig::instance().userId();
 
     METLIBS_LOG_DEBUG(LOGVAL(serverCommand) << LOGVAL(userid) << LOGVAL(mAttemptToStartServer));
 }
@@ -293,6 +796,36 @@ void CoClient::initialize(const QString& ct)
 void CoClient::setUserId(const QString& user)
 {
     userid = user;
+    if (mHashedPlacement)
+        placeServerUrls();
+}
+
+void CoClient::setHashedServerPlacement(bool hashed)
+{
+    mHashedPlacement = hashed;
+    placeServerUrls();
+}
+
+void CoClient::placeServerUrls()
+{
+    const QUrl current = (serverIndex >= 0 && serverIndex < serverUrls.size())
+            ? serverUrls.at(serverIndex) : QUrl();
+    const QUrl standby = (mStandbyIndex >= 0 && mStandbyIndex < serverUrls.size())
+            ? serverUrls.at(mStandbyIndex) : QUrl();
+    if (mHashedPlacement && !mConfiguredUrls.isEmpty()) {
+        serverUrls = coclient::ringOrder(mConfiguredUrls, userid, RING_REPLICAS);
+        METLIBS_LOG_DEBUG("server for user '" << userid << "' is '" << serverUrls.first().toString() << "'");
+    } else {
+        serverUrls = mConfiguredUrls;
+    }
+    // keep pointing at the servers in use
+    if (!current.isEmpty() && serverUrls.contains(current))
+        serverIndex = serverUrls.indexOf(current);
+    if (!standby.isEmpty()) {
+        mStandbyIndex = serverUrls.indexOf(standby);
+        if (mStandbyIndex < 0)
+            closeStandby();
+    }
 }
 
 void CoClient::rewindServerList()
@@ -305,77 +838,186 @@ void CoClient::rewindServerList()
 void CoClient::destroySocket()
 {
     METLIBS_LOG_SCOPE();
-    io.reset(0);
-    if (tcpSocket) {
-        tcpSocket->deleteLater();
-        tcpSocket = 0;
-    }
-    if (localSocket) {
-        localSocket->deleteLater();
-        localSocket = 0;
+    if (mConnection) {
+        // ignore signals still queued from this connection
+        mConnection->disconnect(this);
+        mConnection->deleteLater();
+        mConnection = 0;
     }
+    mConnectionState = UNCONNECTED;
+    mHeartbeatTimer->stop();
+    // pending bytes are gone with the socket
+    keepOfflineMessages();
+    checkSendQueueDrained();
+    mIncoming.clear();
+}
+
+bool CoClient::isCurrentConnection()
+{
+    return mConnection && sender() == mConnection;
 }
 
 void CoClient::createSocket(const QUrl& serverUrl)
 {
     METLIBS_LOG_SCOPE(LOGVAL(serverUrl.toString()));
-    if (serverUrl.scheme() == SCHEME_CO4) {
-        createTcpSocket(serverUrl);
-    } else if (serverUrl.scheme() == SCHEME_LOCAL) {
-        createLocalSocket(serverUrl);
-    } else {
+    const bool tcp = (serverUrl.scheme() == SCHEME_CO4);
+    if (!tcp && serverUrl.scheme() != SCHEME_LOCAL) {
         METLIBS_LOG_ERROR("bad server url '" << serverUrl.toString(QUrl::RemovePassword) << "'");
         return;
     }
+
+    mConnection = newConnection();
+    connectConnectionSignals(mConnection);
+    mConnectionState = CONNECTING;
+    sendReadLimits();
+    startConnecting(mConnection, serverUrl);
 }
 
-void CoClient::createTcpSocket(const QUrl& serverUrl)
+CoConnection* CoClient::newConnection()
 {
-    METLIBS_LOG_SCOPE();
-    tcpSocket = new QTcpSocket(this);
-    connect(tcpSocket, SIGNAL(error(QAbstractSocket::SocketError)),
+    CoConnection* connection = new CoConnection;
+    if (mUseIoThread) {
+        if (!mIoThread) {
+            mIoThread = new QThread(this);
+            mIoThread->start();
+        }
+        connection->moveToThread(mIoThread);
+    } else {
+        connection->setParent(this);
+    }
+    return connection;
+}
+
+void CoClient::connectConnectionSignals(CoConnection* connection)
+{
+    connect(connection, SIGNAL(tcpError(QAbstractSocket::SocketError)),
             SLOT(tcpError(QAbstractSocket::SocketError)));
-    connect(tcpSocket, SIGNAL(connected()),
+    connect(connection, SIGNAL(localError(QLocalSocket::LocalSocketError)),
+            SLOT(localError(QLocalSocket::LocalSocketError)));
+    connect(connection, SIGNAL(connected()),
             SLOT(connectionEstablished()));
-    connect(tcpSocket, SIGNAL(disconnected()),
+    connect(connection, SIGNAL(disconnected()),
             SLOT(connectionClosed()));
-    connect(tcpSocket, SIGNAL(readyRead()),
-            SLOT(readNew()));
+    connect(connection, SIGNAL(received(CoClient::ReceivedMessages, qint64)),
+            SLOT(connectionReceived(CoClient::ReceivedMessages, qint64)));
+    connect(connection, SIGNAL(bytesWritten()),
+            SLOT(connectionBytesWritten()));
+}
 
-    QString host = serverUrl.host();
-    if (host.isEmpty())
-        host = LOCALHOST;
-    const int port = serverUrl.port(qmstrings::port);
-    METLIBS_LOG_INFO("connecting to host '" << host << "' port " << port);
-    tcpSocket->connectToHost(host, port);
+void CoClient::startConnecting(CoConnection* connection, const QUrl& serverUrl)
+{
+    if (serverUrl.scheme() == SCHEME_CO4) {
+        QString host = serverUrl.host();
+        if (host.isEmpty())
+            host = LOCALHOST;
+        const quint16 port = serverUrl.port(qmstrings::port);
+        QMetaObject::invokeMethod(connection, "connectToHost",
+                Q_ARG(QString, host), Q_ARG(quint16, port));
+    } else {
+        QMetaObject::invokeMethod(connection, "connectToServer",
+                Q_ARG(QString, serverUrl.path()));
+    }
 }
 
+void CoClient::startRace()
+{
+    METLIBS_LOG_SCOPE();
+    mRaceOrder.clear();
+    // with hashed placement, the ring order decides
+    const int last = mHashedPlacement ? 0 : serverUrls.indexOf(loadLastServer());
+    if (last >= 0)
+        mRaceOrder << last;
+    for (int i = 0; i < serverUrls.size(); ++i) {
+        const QString& scheme = serverUrls.at(i).scheme();
+        if (i != last && (scheme == SCHEME_CO4 || scheme == SCHEME_LOCAL))
+            mRaceOrder << i;
+    }
+    raceNext();
+}
 
-void CoClient::createLocalSocket(const QUrl& serverUrl)
+void CoClient::raceNext()
 {
     METLIBS_LOG_SCOPE();
-    localSocket = new QLocalSocket(this);
-    connect(localSocket, SIGNAL(error(QLocalSocket::LocalSocketError)),
-            SLOT(localError(QLocalSocket::LocalSocketError)));
-    connect(localSocket, SIGNAL(connected()),
-            SLOT(connectionEstablished()));
-    connect(localSocket, SIGNAL(disconnected()),
-            SLOT(connectionClosed()));
-    connect(localSocket, SIGNAL(readyRead()),
-            SLOT(readNew()));
+    mRaceTimer->stop();
+    if (mRaceOrder.isEmpty()) {
+        if (mRacers.empty()) {
+            METLIBS_LOG_INFO("no server answered, trying one after the other");
+            mRaceFailed = true;
+            serverIndex = 0;
+            connectServer();
+        }
+        return;
+    }
+
+    const int index = mRaceOrder.takeFirst();
+    METLIBS_LOG_INFO("racing connect to '" << serverUrls.at(index).toString(QUrl::RemovePassword) << "'");
+    CoConnection* racer = newConnection();
+    connect(racer, SIGNAL(connected()), SLOT(racerConnected()));
+    connect(racer, SIGNAL(tcpError(QAbstractSocket::SocketError)), SLOT(racerFailed()));
+    connect(racer, SIGNAL(localError(QLocalSocket::LocalSocketError)), SLOT(racerFailed()));
+    mRacers.insert(std::make_pair(racer, index));
+    startConnecting(racer, serverUrls.at(index));
+    if (!mRaceOrder.isEmpty())
+        mRaceTimer->start(mRaceStaggerMs);
+}
+
+void CoClient::racerFailed()
+{
+    racers_t::iterator it = mRacers.find(static_cast<CoConnection*>(sender()));
+    if (it == mRacers.end())
+        return;
+    METLIBS_LOG_DEBUG("racing connect to server " << it->second << " failed");
+    it->first->disconnect(this);
+    it->first->deleteLater();
+    mRacers.erase(it);
+    // do not wait for the stagger delay
+    raceNext();
+}
+
+void CoClient::racerConnected()
+{
+    racers_t::iterator it = mRacers.find(static_cast<CoConnection*>(sender()));
+    if (it == mRacers.end())
+        return;
+    CoConnection* winner = it->first;
+    serverIndex = it->second;
+    mRacers.erase(it);
+    stopRace();
+
+    destroySocket();
+    winner->disconnect(this);
+    mConnection = winner;
+    connectConnectionSignals(mConnection);
+    sendReadLimits();
+    startSession();
+}
+
+void CoClient::stopRace()
+{
+    mRaceTimer->stop();
+    mRaceOrder.clear();
+    for (racers_t::iterator it = mRacers.begin(); it != mRacers.end(); ++it) {
+        it->first->disconnect(this);
+        it->first->deleteLater();
+    }
+    mRacers.clear();
+}
 
-    const QString& path = serverUrl.path();
-    METLIBS_LOG_INFO("connecting to server '" << path << "'");
-    localSocket->connectToServer(path);
+void CoClient::sendReadLimits()
+{
+    if (mConnection)
+        QMetaObject::invokeMethod(mConnection, "setReadLimits",
+                Q_ARG(int, mReadBudgetMessages), Q_ARG(qint64, mReadBufferLimit));
 }
 
 void CoClient::connectToServer()
 {
     METLIBS_LOG_SCOPE();
-    if (tcpSocket || localSocket) {
+    if (mConnection || !mRacers.empty()) {
         METLIBS_LOG_DEBUG("already connected / connecting");
         return;
     }
+    mRaceFailed = false;
     rewindServerList();
     connectServer();
 }
@@ -383,11 +1025,18 @@ void CoClient::connectToServer()
 void CoClient::connectServer()
 {
     METLIBS_LOG_SCOPE();
+    mReconnectTimer->stop();
+    stopRace();
+    closeStandby();
     destroySocket();
     if (serverIndex >= serverUrls.size()) {
         Q_EMIT unableToConnect();
         return;
     }
+    if (mRaceStaggerMs > 0 && serverIndex == 0 && !mRaceFailed && serverUrls.size() > 1) {
+        startRace();
+        return;
+    }
     const QUrl& serverUrl = serverUrls.at(serverIndex);
     createSocket(serverUrl);
 }
@@ -395,39 +1044,34 @@ void CoClient::connectServer()
 void CoClient::disconnectFromServer()
 {
     METLIBS_LOG_SCOPE();
-    if (tcpSocket)
-        tcpSocket->disconnectFromHost();
-    else if (localSocket)
-        localSocket->disconnectFromServer();
+    if (!mConnection)
+        return;
+    // the socket writes pending data before disconnecting
+    if (isConnected())
+        writeOutgoing(true);
+    // an explicit disconnect must not fail over to the standby
+    closeStandby();
+    mConnectionState = CLOSING;
+    QMetaObject::invokeMethod(mConnection, "close");
 }
 
 bool CoClient::notConnected()
 {
-    if (tcpSocket)
-        return (QAbstractSocket::UnconnectedState == tcpSocket->state());
-    else if (localSocket)
-        return (QLocalSocket::UnconnectedState == localSocket->state());
-    else
-        return true;
+    return !mConnection || mConnectionState == UNCONNECTED;
 }
 
 bool CoClient::isConnected()
 {
-    if (tcpSocket)
-        return (QAbstractSocket::ConnectedState == tcpSocket->state());
-    else if (localSocket)
-        return (QLocalSocket::ConnectedState == localSocket->state());
-    else
-        return false;
+    return mConnection && mConnectionState == CONNECTED;
 }
 
 void CoClient::setServerUrls(const QUrlList& urls)
 {
-    const bool wasConnected = isConnected() || !notConnected();
+    const bool wasConnected = isConnected() || !notConnected() || !mRacers.empty();
+    stopRace();
     if (wasConnected)
         disconnectFromServer();
 
-    rewindServerList();
     serverUrls.clear();
     for (int i=0; i<urls.size(); ++i) {
         QUrl u = urls.at(i);
@@ -453,6 +1097,9 @@ void CoClient::setServerUrls(const QUrlList& urls)
             METLIBS_LOG_WARN("invalid url '" << urls.at(i).toString() << "' skipped");
         }
     }
+    mConfiguredUrls = serverUrls;
+    placeServerUrls();
+    rewindServerList();
 
     if (wasConnected)
         tryReconnectAfterTimeout();
@@ -469,31 +1116,1133 @@ QUrl CoClient::getConnectedServerUrl()
 void CoClient::connectionClosed()
 {
     METLIBS_LOG_SCOPE();
+    if (!isCurrentConnection())
+        return;
+    if (!promoteStandby())
+        connectionLost();
+}
+
+void CoClient::connectionLost()
+{
+    METLIBS_LOG_SCOPE();
+    if (mSessionGraceMs > 0 && !mSessionToken.isEmpty() && mId >= 0) {
+        // peers are kept until the session cannot be resumed
+        METLIBS_LOG_INFO("keeping session for " << mSessionGraceMs << "ms");
+        mSessionTimer->start(mSessionGraceMs);
+    } else {
+        forgetClients();
+    }
+    mId = -1;
+    // replies can no longer arrive
+    failRequests();
+
+    Q_EMIT disconnected();
+    destroySocket();
+}
 
+void CoClient::forgetClients()
+{
+    METLIBS_LOG_SCOPE();
+    mSessionTimer->stop();
+    mSessionToken.clear();
     for (clients_t::const_iterator it = clients.begin(); it != clients.end(); ++it) {
         METLIBS_LOG_DEBUG(LOGVAL(it->first));
         Q_EMIT clientChange(it->first, CLIENT_GONE);
         Q_EMIT clientChange(it->first, CLIENT_UNREGISTERED);
     }
     clients.clear();
-    mId = -1;
+    mPeerIds.clear();
+    mDuplicates->clear();
+    mOriginClients.clear();
+    mLocalIds.clear();
+    mServerIds.clear();
+    clearResponseCache();
+    mPeerViewports.clear();
+    // sender ids are meaningless with the next server session
+    mScheduled.clear();
+    mScheduleTimer->stop();
+}
+
+void CoClient::setHeartbeat(int intervalMs, int missCount)
+{
+    mHeartbeatMisses = std::max(missCount, 1);
+    if (intervalMs > 0) {
+        mHeartbeatTimer->setInterval(intervalMs);
+        if (isConnected())
+            mHeartbeatTimer->start();
+    } else {
+        mHeartbeatTimer->setInterval(0);
+        mHeartbeatTimer->stop();
+    }
+}
+
+void CoClient::sendHeartbeat()
+{
+    METLIBS_LOG_SCOPE();
+    if (!isConnected()) {
+        mHeartbeatTimer->stop();
+        return;
+    }
+    if (mHeartbeatOutstanding >= mHeartbeatMisses) {
+        METLIBS_LOG_WARN("no answer from server for " << mHeartbeatOutstanding
+                << " heartbeats, trying next server");
+        if (promoteStandby())
+            return;
+        connectionLost();
+        if (serverIndex + 1 < serverUrls.size()) {
+            tryConnectNextServer();
+        } else {
+            // start over instead of giving up after the last server
+            rewindServerList();
+            tryReconnectAfterTimeout();
+        }
+        return;
+    }
+    mHeartbeatOutstanding += 1;
+
+    const quint32 seq = ++mHeartbeatSeq;
+    mPingsSent[seq] = mClock.elapsed();
+    while (mPingsSent.size() > size_t(PINGS_KEPT))
+        mPingsSent.erase(mPingsSent.begin());
+
+    miQMessage ping(qmstrings::ping);
+    ping.addCommon(qmstrings::seq, QString::number(seq));
+    sendMessageToServer(ping);
+}
+
+void CoClient::handlePong(const miQMessage& qmsg)
+{
+    const quint32 seq = qmsg.getCommonValue(qmstrings::seq).toUInt();
+    std::map<quint32, qint64>::iterator it = mPingsSent.find(seq);
+    if (it == mPingsSent.end())
+        return;
+    const int rtt = int(mClock.elapsed() - it->second);
+    mPingsSent.erase(mPingsSent.begin(), ++it);
+
+    // smoothing as for TCP retransmission timers, RFC 6298; scaled by 8
+    // so that small differences are not lost to integer division
+    if (mSmoothedRtt8 < 0)
+        mSmoothedRtt8 = rtt << 3;
+    else
+        mSmoothedRtt8 += rtt - (mSmoothedRtt8 >> 3);
+    METLIBS_LOG_DEBUG(LOGVAL(rtt) << LOGVAL(smoothedRtt()));
+    Q_EMIT roundTripTime(smoothedRtt());
+}
+
+void CoClient::setHotStandby(bool standby)
+{
+    mHotStandby = standby;
+    if (!mHotStandby)
+        closeStandby();
+    else if (isConnected())
+        scheduleStandby(0);
+}
+
+bool CoClient::isDuplicate(const miQMessage& qmsg)
+{
+    const int idxOrigin = qmsg.findCommonDesc(qmstrings::origin);
+    const int idxSeq = qmsg.findCommonDesc(qmstrings::origin_seq);
+    if (idxOrigin < 0 || idxSeq < 0)
+        return false;
+
+    const quint32 seq = qmsg.getCommonValue(idxSeq).toUInt();
+    if (!mDuplicates->isDuplicate(qmsg.getCommonValue(idxOrigin), seq))
+        return false;
+    METLIBS_LOG_DEBUG("dropping duplicate '" << qmsg.command() << "' message");
+    return true;
+}
+
+void CoClient::scheduleStandby(int delayMs)
+{
+    if (mHotStandby && !mStandby && serverUrls.size() > 1)
+        mStandbyTimer->start(delayMs);
+}
+
+void CoClient::connectStandby()
+{
+    METLIBS_LOG_SCOPE();
+    if (!mHotStandby || mStandby || !isConnected())
+        return;
+    for (int i = 1; i < serverUrls.size(); ++i) {
+        const int index = (serverIndex + i) % serverUrls.size();
+        const QUrl& url = serverUrls.at(index);
+        if (url.scheme() != SCHEME_CO4 && url.scheme() != SCHEME_LOCAL)
+            continue;
+
+        METLIBS_LOG_INFO("connecting standby to '" << url.toString(QUrl::RemovePassword) << "'");
+        mStandby = newConnection();
+        mStandbyIndex = index;
+        mStandbyId = -1;
+        connect(mStandby, SIGNAL(connected()), SLOT(standbyConnected()));
+        connect(mStandby, SIGNAL(disconnected()), SLOT(standbyClosed()));
+        connect(mStandby, SIGNAL(tcpError(QAbstractSocket::SocketError)), SLOT(standbyClosed()));
+        connect(mStandby, SIGNAL(localError(QLocalSocket::LocalSocketError)), SLOT(standbyClosed()));
+        connect(mStandby, SIGNAL(received(CoClient::ReceivedMessages, qint64)),
+                SLOT(standbyReceived(CoClient::ReceivedMessages, qint64)));
+        startConnecting(mStandby, url);
+        return;
+    }
+}
+
+void CoClient::closeStandby()
+{
+    mStandbyTimer->stop();
+    if (mStandby) {
+        mStandby->disconnect(this);
+        mStandby->deleteLater();
+        mStandby = 0;
+    }
+    mStandbyIndex = -1;
+    mStandbyId = -1;
+    mStandbySessionToken.clear();
+    mStandbyClients.clear();
+    mStandbyOrigins.clear();
+    mStandbyIncoming.clear();
+    mStandbyConsumedMessages = 0;
+    mStandbyConsumedBytes = 0;
+}
+
+void CoClient::standbyConnected()
+{
+    METLIBS_LOG_SCOPE();
+    if (!mStandby || sender() != mStandby)
+        return;
+    sendToStandby(clientTypeMessage());
+}
+
+void CoClient::standbyClosed()
+{
+    METLIBS_LOG_SCOPE();
+    if (!mStandby || sender() != mStandby)
+        return;
+    METLIBS_LOG_INFO("standby connection lost");
+    closeStandby();
+    scheduleStandby(STANDBY_RETRY_MS);
+}
+
+void CoClient::standbyReceived(const CoClient::ReceivedMessages& messages, qint64 bytes)
+{
+    METLIBS_LOG_SCOPE(LOGVAL(messages.size()));
+    if (!mStandby || sender() != mStandby)
+        return;
+    mStandbyConsumedMessages += messages.size();
+    mStandbyConsumedBytes += bytes;
+
+    int unused = 0;
+    for (int i = 0; i < messages.size(); ++i) {
+        const ReceivedMessage& rm = messages.at(i);
+        if (rm.from == 0) {
+            trackStandbyRegistry(rm.qmsg);
+            unused += 1;
+            continue;
+        }
+        const int idxOrigin = rm.qmsg.findCommonDesc(qmstrings::origin);
+        if (idxOrigin < 0) {
+            unused += 1;
+            continue;
+        }
+        const QString& origin = rm.qmsg.getCommonValue(idxOrigin);
+        mStandbyOrigins[origin] = rm.from;
+
+        // copies are delivered with the sender's id at the active server;
+        // without a known sender, the original from the active server is used
+        origin_clients_t::const_iterator it = mOriginClients.find(origin);
+        if (it == mOriginClients.end()) {
+            unused += 1;
+            continue;
+        }
+        mStandbyIncoming << ReceivedMessage(it->second, rm.qmsg);
+    }
+    if (unused > 0)
+        QMetaObject::invokeMethod(mStandby, "consumed", Q_ARG(int, unused));
+    sendStandbyCredits(false);
+    if (!mStandbyIncoming.isEmpty())
+        deliverIncoming();
+}
+
+void CoClient::trackStandbyRegistry(const miQMessage& qmsg)
+{
+    const QString& command = qmsg.command();
+    switch (qmstrings::command_hash(command)) {
+    case qmstrings::ids::registeredclient: {
+        if (command != qmstrings::registeredclient)
+            break;
+        const int idxMyId = qmsg.findCommonDesc("id");
+        if (idxMyId >= 0) {
+            mStandbyId = qmsg.getCommonValue(idxMyId).toInt();
+            mStandbySessionToken = qmsg.getCommonValue(qmstrings::session);
+        }
+        const int idxId = qmsg.findDataDesc("id"),
+                idxType = qmsg.findDataDesc("type"),
+                idxName = qmsg.findDataDesc("name");
+        if (idxId >= 0 && idxName >= 0 && idxType >= 0) {
+            for (int i=0; i<qmsg.countDataRows(); ++i) {
+                mStandbyClients.insert(std::make_pair(qmsg.getDataValue(i, idxId).toInt(),
+                                Client(qmsg.getDataValue(i, idxType), qmsg.getDataValue(i, idxName), false)));
+            }
+        }
+        sendStandbySetPeers();
+        if (idxMyId >= 0) {
+            // the standby must deliver as the active server would
+            if (mCreditMessages > 0 || mCreditBytes > 0)
+                sendStandbyCredits(true);
+            if (!mSubscriptions.isEmpty())
+                sendStandbySubscriptions();
+        }
+        break;
+    }
+    case qmstrings::ids::unregisteredclient: {
+        if (command != qmstrings::unregisteredclient)
+            break;
+        const int idxId = qmsg.findDataDesc("id");
+        for (int i=0; idxId >= 0 && i<qmsg.countDataRows(); ++i) {
+            const int id = qmsg.getDataValue(i, idxId).toInt();
+            mStandbyClients.erase(id);
+            eraseOrigins(mStandbyOrigins, id);
+        }
+        sendStandbySetPeers();
+        break;
+    }
+    case qmstrings::ids::newclient:
+    case qmstrings::ids::removeclient: {
+        const bool connected = (command == qmstrings::newclient);
+        if (!connected && command != qmstrings::removeclient)
+            break;
+        clients_t::iterator it = mStandbyClients.find(qmsg.getCommonValue("id").toInt());
+        if (it != mStandbyClients.end())
+            it->second.connected = connected;
+        break;
+    }
+    case qmstrings::ids::renameclient: {
+        if (command != qmstrings::renameclient)
+            break;
+        clients_t::iterator it = mStandbyClients.find(qmsg.getCommonValue("id").toInt());
+        if (it != mStandbyClients.end())
+            it->second.name = qmsg.getCommonValue("name");
+        sendStandbySetPeers();
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void CoClient::sendStandbySetPeers()
+{
+    if (!mStandby || mStandbyId < 0)
+        return;
+    miQMessage setpeers("SETPEERS");
+    setpeers.addDataDesc("peer_ids");
+    for (clients_t::const_iterator it = mStandbyClients.begin(); it != mStandbyClients.end(); ++it) {
+        if (mSelectedPeerNames.isEmpty() || mSelectedPeerNames.contains(it->second.name))
+            setpeers.addDataValues(QStringList(QString::number(it->first)));
+    }
+    sendToStandby(setpeers);
+}
+
+void CoClient::sendStandbyCredits(bool initial)
+{
+    if (!mStandby || mStandbyId < 0)
+        return;
+    miQMessage credits;
+    if (creditsMessage(initial, mStandbyConsumedMessages, mStandbyConsumedBytes, credits))
+        sendToStandby(credits);
+}
+
+void CoClient::sendStandbySubscriptions()
+{
+    if (!mStandby || mStandbyId < 0)
+        return;
+    sendToStandby(subscriptionsMessage());
+}
+
+void CoClient::sendToStandby(const miQMessage& qmsg)
+{
+    CoConnection::Messages messages;
+    messages << CoConnection::Message(clientId(0), qmsg);
+    sendThrough(mStandby, messages);
+}
+
+bool CoClient::promoteStandby()
+{
+    METLIBS_LOG_SCOPE();
+    if (!mStandby || mStandbyId < 0 || mStandbyIndex < 0 || mConnectionState == CLOSING)
+        return false;
+    METLIBS_LOG_INFO("switching to standby server '"
+            << serverUrls.at(mStandbyIndex).toString(QUrl::RemovePassword) << "'");
+
+    // replies to requests sent through the old server cannot arrive
+    failRequests();
+    destroySocket();
+
+    // peers known through both servers keep their ids; others get the
+    // id from the standby server unless an old peer has it
+    id_map_t standbyToLocal;
+    matchStandbyPeers(standbyToLocal);
+    clients_t previous;
+    previous.swap(clients);
+    mLocalIds.clear();
+    mServerIds.clear();
+    for (clients_t::const_iterator it = mStandbyClients.begin(); it != mStandbyClients.end(); ++it) {
+        id_map_t::const_iterator m = standbyToLocal.find(it->first);
+        int id = it->first;
+        if (m != standbyToLocal.end()) {
+            id = m->second;
+        } else {
+            while (id == mStandbyId || previous.count(id) || mServerIds.count(id))
+                ++id;
+        }
+        clients.insert(std::make_pair(id, it->second));
+        mLocalIds[it->first] = id;
+        mServerIds[id] = it->first;
+    }
+
+    mConnection = mStandby;
+    mStandby = 0;
+    serverIndex = mStandbyIndex;
+    mId = mStandbyId;
+    mSessionTimer->stop();
+    mSessionToken = mStandbySessionToken;
+    mSessionId = mStandbyId;
+    // copies not delivered yet, and credits used, continue on the new connection
+    mIncoming.swap(mStandbyIncoming);
+    mConsumedMessages = mStandbyConsumedMessages;
+    mConsumedBytes = mStandbyConsumedBytes;
+    closeStandby();
+
+    mConnection->disconnect(this);
+    connectConnectionSignals(mConnection);
+    mConnectionState = CONNECTED;
+    mHeartbeatOutstanding = 0;
+    if (mHeartbeatTimer->interval() > 0)
+        mHeartbeatTimer->start();
+    sendReadLimits();
+    if (mRaceStaggerMs > 0)
+        saveLastServer(getConnectedServerUrl());
+
+    Q_EMIT receivedId(mId);
+    for (clients_t::const_iterator it = previous.begin(); it != previous.end(); ++it) {
+        if (clients.count(it->first))
+            continue;
+        if (it->second.connected)
+            Q_EMIT clientChange(it->first, CLIENT_GONE);
+        Q_EMIT clientChange(it->first, CLIENT_UNREGISTERED);
+        forgetPeer(it->first);
+    }
+    for (clients_t::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        clients_t::const_iterator p = previous.find(it->first);
+        if (p == previous.end()) {
+            Q_EMIT clientChange(it->first, CLIENT_REGISTERED);
+            if (it->second.connected)
+                Q_EMIT clientChange(it->first, CLIENT_NEW);
+            continue;
+        }
+        if (p->second.connected != it->second.connected) {
+            if (!it->second.connected) {
+                invalidateResponses(it->first, QString());
+                mPeerViewports.erase(it->first);
+            }
+            Q_EMIT clientChange(it->first, it->second.connected ? CLIENT_NEW : CLIENT_GONE);
+        }
+        if (p->second.name != it->second.name)
+            Q_EMIT clientChange(it->first, CLIENT_RENAME);
+    }
+    Q_EMIT addressListChanged();
+
+    // credits and subscriptions were sent when the standby registered
+    sendSetPeers();
+    if (mHasViewport)
+        sendViewport(ClientIds());
+    releaseHeldMessages();
+    if (!mIncoming.isEmpty())
+        scheduleDeliver();
+
+    scheduleStandby(0);
+    return true;
+}
+
+void CoClient::matchStandbyPeers(id_map_t& standbyToLocal) const
+{
+    std::set<int> matched; // application ids
+
+    // peers that sent to all through both servers used the same origin
+    for (origin_clients_t::const_iterator it = mStandbyOrigins.begin(); it != mStandbyOrigins.end(); ++it) {
+        origin_clients_t::const_iterator local = mOriginClients.find(it->first);
+        if (local == mOriginClients.end() || !clients.count(local->second)
+                || !mStandbyClients.count(it->second)
+                || standbyToLocal.count(it->second) || matched.count(local->second))
+        {
+            continue;
+        }
+        standbyToLocal[it->second] = local->second;
+        matched.insert(local->second);
+    }
+
+    // others are matched by type and name if that is unambiguous
+    for (clients_t::const_iterator s = mStandbyClients.begin(); s != mStandbyClients.end(); ++s) {
+        if (standbyToLocal.count(s->first))
+            continue;
+        int twins = 0;
+        for (clients_t::const_iterator t = mStandbyClients.begin(); t != mStandbyClients.end(); ++t) {
+            if (!standbyToLocal.count(t->first) && t->second.type == s->second.type
+                    && t->second.name == s->second.name)
+                twins += 1;
+        }
+        int candidate = -1, candidates = 0;
+        for (clients_t::const_iterator c = clients.begin(); c != clients.end(); ++c) {
+            if (!matched.count(c->first) && c->second.type == s->second.type
+                    && c->second.name == s->second.name)
+            {
+                candidate = c->first;
+                candidates += 1;
+            }
+        }
+        if (twins == 1 && candidates == 1) {
+            standbyToLocal[s->first] = candidate;
+            matched.insert(candidate);
+        }
+    }
+}
+
+int CoClient::localId(int id)
+{
+    // ids are only translated after switching to the standby server
+    if (mLocalIds.empty())
+        return id;
+    id_map_t::const_iterator it = mLocalIds.find(id);
+    if (it != mLocalIds.end())
+        return it->second;
+    // a new peer keeps its id unless another peer has it already
+    int local = id;
+    while (local == mId || mServerIds.count(local) || clients.count(local))
+        ++local;
+    mLocalIds[id] = local;
+    mServerIds[local] = id;
+    return local;
+}
+
+int CoClient::serverId(int id) const
+{
+    id_map_t::const_iterator it = mServerIds.find(id);
+    return (it != mServerIds.end()) ? it->second : id;
+}
+
+ClientIds CoClient::serverIds(const ClientIds& ids) const
+{
+    if (mServerIds.empty())
+        return ids;
+    ClientIds translated;
+    for (ClientIds::const_iterator it = ids.begin(); it != ids.end(); ++it)
+        translated.insert(serverId(*it));
+    return translated;
+}
+
+void CoClient::forgetPeer(int id)
+{
+    const QStringList origins = eraseOrigins(mOriginClients, id);
+    for (QStringList::const_iterator it = origins.begin(); it != origins.end(); ++it)
+        mDuplicates->forget(*it);
+    id_map_t::iterator s = mServerIds.find(id);
+    if (s != mServerIds.end()) {
+        mLocalIds.erase(s->second);
+        mServerIds.erase(s);
+    }
+    invalidateResponses(id, QString());
+    mPeerViewports.erase(id);
+    for (scheduled_t::iterator it = mScheduled.begin(); it != mScheduled.end();) {
+        if (it->second.from == id)
+            mScheduled.erase(it++);
+        else
+            ++it;
+    }
+}
+
+void CoClient::sessionExpired()
+{
+    METLIBS_LOG_INFO("session could not be resumed in time");
+    forgetClients();
+}
+
+void CoClient::connectionReceived(const CoClient::ReceivedMessages& messages, qint64 bytes)
+{
+    METLIBS_LOG_SCOPE(LOGVAL(messages.size()));
+    if (!isCurrentConnection())
+        return;
+    // any data shows that the server is alive
+    mHeartbeatOutstanding = 0;
+    const int first = mIncoming.size();
+    mIncoming += messages;
+    if (mHotStandby || !mLocalIds.empty()) {
+        for (int i = first; i < mIncoming.size(); ++i) {
+            ReceivedMessage& rm = mIncoming[i];
+            if (rm.from == 0)
+                continue;
+            rm.from = localId(rm.from);
+            // copies from the standby server are matched to senders by origin
+            const int idxOrigin = rm.qmsg.findCommonDesc(qmstrings::origin);
+            if (idxOrigin >= 0)
+                mOriginClients[rm.qmsg.getCommonValue(idxOrigin)] = rm.from;
+        }
+    }
+    mConsumedMessages += messages.size();
+    mConsumedBytes += bytes;
+    deliverIncoming();
+}
+
+void CoClient::deliverIncoming()
+{
+    METLIBS_LOG_SCOPE();
+    mDeliverScheduled = false;
+    if (mDelivering) {
+        // called from a nested event loop in a slot, continue later
+        scheduleDeliver();
+        return;
+    }
+    CoConnection* connection = mConnection;
+    if (!connection || (mIncoming.isEmpty() && mStandbyIncoming.isEmpty()))
+        return;
+    mDelivering = true;
+
+    QElapsedTimer timer;
+    timer.start();
+    const qint64 budgetNs = qint64(mReadBudgetMicroseconds) * 1000;
+
+    const int available = mIncoming.size();
+    dropSuperseded(mIncoming);
+    CoConnection* standby = mStandby;
+    const int availableStandby = mStandbyIncoming.size();
+    dropSuperseded(mStandbyIncoming);
+
+    ReceivedMessages incoming;
+    incoming.swap(mIncoming);
+    // copies from the standby follow, with the sender ids of the active server
+    const int standbyStart = incoming.size();
+    incoming += mStandbyIncoming;
+    mStandbyIncoming.clear();
+    ReceivedMessages batch;
+    int delivered = 0;
+    for (; delivered < incoming.size(); ++delivered) {
+        if (mConnection != connection) {
+            METLIBS_LOG_DEBUG("connection closed, not delivering remaining messages");
+            break;
+        }
+        if (delivered > 0
+                && ((mReadBudgetMessages > 0 && delivered >= mReadBudgetMessages)
+                        || (budgetNs > 0 && timer.nsecsElapsed() >= budgetNs)))
+        {
+            break;
+        }
+        const ReceivedMessage& rm = incoming.at(delivered);
+        bool send = true;
+        if (rm.from == 0)
+            send = messageFromServer(rm.qmsg);
+        if (rm.from != 0 && mHotStandby && isDuplicate(rm.qmsg))
+            continue;
+        if (rm.from != 0 && handleViewport(rm.from, rm.qmsg))
+            continue;
+        if (rm.from != 0 && !isSubscribed(rm.qmsg.command())) {
+            METLIBS_LOG_DEBUG("ignoring unsubscribed '" << rm.qmsg.command() << "' message");
+            continue;
+        }
+        if (rm.from != 0 && mScheduledDelivery && scheduleDelivery(rm))
+            continue;
+        if (rm.from != 0)
+            invalidateResponses(rm.from, rm.qmsg.command());
+        if (!send || (rm.from != 0 && dispatchReply(rm.from, rm.qmsg))
+                || dispatchToHandlers(rm.from, rm.qmsg))
+        {
+            continue;
+        }
+        if (mBatchedDelivery)
+            batch << rm;
+        else
+            emitMessage(rm.from, rm.qmsg);
+    }
+    if (!batch.isEmpty())
+        Q_EMIT receivedMessages(batch);
+
+    // standby copies not delivered within the budget, if still wanted
+    const int standbyFirst = std::max(delivered, standbyStart);
+    const int remainingStandby = incoming.size() - standbyFirst;
+    if (mConnection == connection) {
+        // keep what could not be delivered within the budget, before
+        // messages received in a nested event loop
+        const int remaining = std::max(standbyStart - delivered, 0);
+        mIncoming = incoming.mid(delivered, remaining) + mIncoming;
+        const int consumed = available - remaining;
+        if (consumed > 0)
+            QMetaObject::invokeMethod(mConnection, "consumed", Q_ARG(int, consumed));
+        int left = remaining;
+        if (standby && mStandby == standby) {
+            mStandbyIncoming = incoming.mid(standbyFirst) + mStandbyIncoming;
+            const int consumedStandby = availableStandby - remainingStandby;
+            if (consumedStandby > 0)
+                QMetaObject::invokeMethod(mStandby, "consumed", Q_ARG(int, consumedStandby));
+            sendStandbyCredits(false);
+            left += remainingStandby;
+        }
+        if (left > 0) {
+            METLIBS_LOG_DEBUG("read budget exhausted, " << left << " messages left");
+            scheduleDeliver();
+        }
+        sendCredits(false);
+    } else if (standby && mConnection == standby) {
+        // switched to the standby while delivering, its copies are still valid
+        mIncoming = incoming.mid(standbyFirst) + mIncoming;
+        const int consumedStandby = availableStandby - remainingStandby;
+        if (consumedStandby > 0)
+            QMetaObject::invokeMethod(mConnection, "consumed", Q_ARG(int, consumedStandby));
+        if (!mIncoming.isEmpty())
+            scheduleDeliver();
+    }
+    mDelivering = false;
+}
+
+void CoClient::setReceiveBufferLimit(qint64 bytes)
+{
+    mReadBufferLimit = std::max(bytes, qint64(0));
+    sendReadLimits();
+}
+
+void CoClient::setReceiveCredits(int maxMessages, qint64 maxBytes)
+{
+    const bool wasEnabled = (mCreditMessages > 0 || mCreditBytes > 0);
+    mCreditMessages = std::max(maxMessages, 0);
+    mCreditBytes = std::max(maxBytes, qint64(0));
+    if (wasEnabled || mCreditMessages > 0 || mCreditBytes > 0) {
+        sendCredits(true);
+        sendStandbyCredits(true);
+    }
+}
+
+void CoClient::sendCredits(bool initial)
+{
+    if (!isConnected() || mId < 0)
+        return;
+    miQMessage credits;
+    if (creditsMessage(initial, mConsumedMessages, mConsumedBytes, credits))
+        sendMessageToServer(credits);
+}
+
+/*! Makes SETCREDITS if initial, else ADDCREDITS when half of the credits
+ *  are used up, and resets the consumed counts. Returns false if there
+ *  is nothing to send.
+ */
+bool CoClient::creditsMessage(bool initial, int& consumedMessages, qint64& consumedBytes,
+        miQMessage& credits) const
+{
+    if (initial) {
+        // also sent with both limits 0, to switch credits off again
+        credits = miQMessage("SETCREDITS");
+        credits.addCommon("messages", mCreditMessages);
+        credits.addCommon("bytes", QString::number(mCreditBytes));
+    } else {
+        if (mCreditMessages <= 0 && mCreditBytes <= 0)
+            return false;
+        const bool due = (mCreditMessages > 0 && 2*consumedMessages >= mCreditMessages)
+                || (mCreditBytes > 0 && 2*consumedBytes >= mCreditBytes);
+        if (!due)
+            return false;
+        credits = miQMessage("ADDCREDITS");
+        credits.addCommon("messages", consumedMessages);
+        credits.addCommon("bytes", QString::number(consumedBytes));
+    }
+    consumedMessages = 0;
+    consumedBytes = 0;
+    return true;
+}
+
+void CoClient::setReadBudget(int maxMessages, int maxMicroseconds)
+{
+    mReadBudgetMessages = std::max(maxMessages, 0);
+    mReadBudgetMicroseconds = std::max(maxMicroseconds, 0);
+    sendReadLimits();
+}
+
+void CoClient::scheduleDeliver()
+{
+    if (!mDeliverScheduled) {
+        mDeliverScheduled = true;
+        QTimer::singleShot(0, this, SLOT(deliverIncoming()));
+    }
+}
+
+void CoClient::setLatestValueDelivery(const QString& command, const QString& commonField)
+{
+    removeLatestValueDelivery(command);
+    mLatestValueDelivery.insert(std::make_pair(command, ConflationRule(commonField, 0)));
+}
+
+void CoClient::removeLatestValueDelivery(const QString& command)
+{
+    mLatestValueDelivery.erase(command);
+}
+
+void CoClient::dropSuperseded(ReceivedMessages& incoming)
+{
+    if (mLatestValueDelivery.empty() || incoming.size() < 2)
+        return;
+
+    // walk backwards, keeping only the first (i.e. newest) message per key
+    std::set<QString> newer;
+    std::vector<bool> drop(incoming.size(), false);
+    for (int i = incoming.size(); i-- > 0; ) {
+        const ReceivedMessage& rm = incoming.at(i);
+        if (rm.from == 0)
+            continue;
+        conflation_t::const_iterator rule = mLatestValueDelivery.find(rm.qmsg.command());
+        if (rule == mLatestValueDelivery.end())
+            continue;
+        const QString key = conflationKey(rm.qmsg, rule->second.commonField)
+                + KEY_SEPARATOR + QString::number(rm.from);
+        if (!newer.insert(key).second)
+            drop[i] = true;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < incoming.size(); ++i) {
+        if (drop[i])
+            continue;
+        if (kept != i)
+            incoming[kept] = incoming[i];
+        kept += 1;
+    }
+    if (kept < incoming.size()) {
+        METLIBS_LOG_DEBUG("dropping " << (incoming.size() - kept) << " superseded messages");
+        mDroppedMessages += incoming.size() - kept;
+        incoming.erase(incoming.begin() + kept, incoming.end());
+    }
+}
+
+void CoClient::registerHandler(const QString& command, const MessageHandler& handler)
+{
+    mHandlers[qmstrings::command_hash(command)].push_back(Handler(command, handler));
+}
+
+void CoClient::unregisterHandlers(const QString& command)
+{
+    handlers_t::iterator it = mHandlers.find(qmstrings::command_hash(command));
+    if (it == mHandlers.end())
+        return;
+    handler_list_t& handlers = it->second;
+    for (handler_list_t::iterator h = handlers.begin(); h != handlers.end(); ) {
+        if (h->command == command)
+            h = handlers.erase(h);
+        else
+            ++h;
+    }
+    if (handlers.empty())
+        mHandlers.erase(it);
+}
+
+bool CoClient::dispatchToHandlers(int fromId, const miQMessage& qmsg)
+{
+    if (mHandlers.empty())
+        return false;
+    handlers_t::const_iterator it = mHandlers.find(qmstrings::command_hash(qmsg.command()));
+    if (it == mHandlers.end())
+        return false;
+
+    // copy, a handler might (un)register handlers
+    const handler_list_t handlers = it->second;
+    bool handled = false;
+    for (handler_list_t::const_iterator h = handlers.begin(); h != handlers.end(); ++h) {
+        if (h->command == qmsg.command()) {
+            h->handler(fromId, qmsg);
+            handled = true;
+        }
+    }
+    return handled;
+}
+
+quint32 CoClient::request(const miQMessage& qmsg, int toId, const QString& replyCommand,
+        const ReplyHandler& handler, int timeoutMs)
+{
+    METLIBS_LOG_SCOPE(qmsg);
+    const quint32 id = mNextRequestId++;
+    if (mNextRequestId == 0)
+        mNextRequestId = 1;
+
+    QString cacheKey;
+    if (mCachingRules.find(qmsg.command()) != mCachingRules.end()) {
+        cacheKey = requestKey(toId, qmsg);
+        response_cache_t::iterator cached = mResponseCache.find(cacheKey);
+        if (cached != mResponseCache.end()) {
+            if (cached->second.expires == 0 || cached->second.expires > mClock.elapsed()) {
+                METLIBS_LOG_DEBUG("answering '" << qmsg.command() << "' from cache");
+                const CachedResponse response = cached->second;
+                handler(true, response.from, response.reply);
+                return id;
+            }
+            mResponseCache.erase(cached);
+        }
+    }
+
+    miQMessage tagged(qmsg);
+    tagged.addCommon(qmstrings::request_id, QString::number(id));
+    ClientIds to;
+    if (toId != qmstrings::all)
+        to.insert(toId);
+    if (!sendMessage(tagged, to))
+        return 0;
+
+    mRequests.push_back(PendingRequest(id, toId, replyCommand, handler,
+                    mClock.elapsed() + std::max(timeoutMs, 0)));
+    mRequests.back().requestCommand = qmsg.command();
+    mRequests.back().cacheKey = cacheKey;
+    scheduleRequestTimer();
+    return id;
+}
+
+void CoClient::cancelRequest(quint32 requestId)
+{
+    for (requests_t::iterator it = mRequests.begin(); it != mRequests.end(); ++it) {
+        if (it->id == requestId) {
+            mRequests.erase(it);
+            break;
+        }
+    }
+    scheduleRequestTimer();
+}
+
+bool CoClient::sendReply(const miQMessage& request, int toId, const miQMessage& reply)
+{
+    const int idx = request.findCommonDesc(qmstrings::request_id);
+    if (idx < 0)
+        return sendMessage(reply, clientId(toId));
+    miQMessage tagged(reply);
+    tagged.addCommon(qmstrings::request_id, request.getCommonValue(idx));
+    return sendMessage(tagged, clientId(toId));
+}
+
+bool CoClient::dispatchReply(int fromId, const miQMessage& qmsg)
+{
+    if (mRequests.empty())
+        return false;
+
+    requests_t::iterator match = mRequests.end();
+    const int idx = qmsg.findCommonDesc(qmstrings::request_id);
+    if (idx >= 0) {
+        const quint32 id = qmsg.getCommonValue(idx).toUInt();
+        for (requests_t::iterator it = mRequests.begin(); it != mRequests.end(); ++it) {
+            if (it->id == id) {
+                match = it;
+                break;
+            }
+        }
+    } else {
+        for (requests_t::iterator it = mRequests.begin(); it != mRequests.end(); ++it) {
+            if (it->replyCommand == qmsg.command() && (it->to == fromId || it->to == qmstrings::all)) {
+                match = it;
+                break;
+            }
+        }
+    }
+    if (match == mRequests.end())
+        return false;
+
+    if (!match->cacheKey.isEmpty()) {
+        caching_rules_t::const_iterator rule = mCachingRules.find(match->requestCommand);
+        if (rule != mCachingRules.end()) {
+            CachedResponse& response = mResponseCache[match->cacheKey];
+            response.requestCommand = match->requestCommand;
+            response.peer = match->to;
+            response.from = fromId;
+            response.reply = qmsg;
+            response.expires = (rule->second.ttl > 0) ? (mClock.elapsed() + rule->second.ttl) : 0;
+        }
+    }
+
+    // copy, the handler might send new requests
+    const ReplyHandler handler = match->handler;
+    mRequests.erase(match);
+    scheduleRequestTimer();
+    handler(true, fromId, qmsg);
+    // a reply without request id might as well be an unsolicited message
+    // other receivers are waiting for
+    return idx >= 0;
+}
+
+void CoClient::setResponseCaching(const QString& requestCommand,
+        const QStringList& invalidatingCommands, int ttl)
+{
+    removeResponseCaching(requestCommand);
+    mCachingRules.insert(std::make_pair(requestCommand, CachingRule(invalidatingCommands, ttl)));
+}
+
+void CoClient::removeResponseCaching(const QString& requestCommand)
+{
+    mCachingRules.erase(requestCommand);
+    response_cache_t::iterator next = mResponseCache.begin();
+    while (next != mResponseCache.end()) {
+        response_cache_t::iterator it = next++;
+        if (it->second.requestCommand == requestCommand)
+            mResponseCache.erase(it);
+    }
+}
+
+void CoClient::clearResponseCache()
+{
+    mResponseCache.clear();
+}
+
+void CoClient::invalidateResponses(int fromId, const QString& command)
+{
+    if (mResponseCache.empty())
+        return;
+    response_cache_t::iterator next = mResponseCache.begin();
+    while (next != mResponseCache.end()) {
+        response_cache_t::iterator it = next++;
+        const CachedResponse& response = it->second;
+        if (response.peer != fromId && response.from != fromId)
+            continue;
+        caching_rules_t::const_iterator rule = mCachingRules.find(response.requestCommand);
+        if (command.isEmpty() || rule == mCachingRules.end()
+                || rule->second.invalidatingCommands.contains(command))
+        {
+            METLIBS_LOG_DEBUG("invalidating cached reply to '" << response.requestCommand << "'");
+            mResponseCache.erase(it);
+        }
+    }
+}
+
+bool CoClient::sendScheduled(const miQMessage& qmsg, qint64 atMsecsSinceEpoch,
+        const QStringList& upcoming, const ClientIds& to)
+{
+    miQMessage scheduled(qmsg);
+    scheduled.addCommon(qmstrings::scheduled_at, QString::number(atMsecsSinceEpoch));
+    if (!upcoming.isEmpty())
+        scheduled.addCommon(qmstrings::upcoming, upcoming.join(","));
+    return sendMessage(scheduled, to);
+}
+
+void CoClient::setScheduledDelivery(bool scheduled)
+{
+    mScheduledDelivery = scheduled;
+    if (!mScheduledDelivery && !mScheduled.empty()) {
+        // deliver everything waiting now
+        mScheduleTimer->stop();
+        QTimer::singleShot(0, this, SLOT(deliverScheduled()));
+    }
+}
+
+bool CoClient::scheduleDelivery(const ReceivedMessage& rm)
+{
+    const int idx = rm.qmsg.findCommonDesc(qmstrings::scheduled_at);
+    if (idx < 0)
+        return false;
+    bool ok = false;
+    const qint64 at = rm.qmsg.getCommonValue(idx).toLongLong(&ok);
+    if (!ok)
+        return false;
+
+    QStringList upcoming;
+    const int idxUpcoming = rm.qmsg.findCommonDesc(qmstrings::upcoming);
+    if (idxUpcoming >= 0) {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+        upcoming = rm.qmsg.getCommonValue(idxUpcoming).split(",", Qt::SkipEmptyParts);
+#else
+        upcoming = rm.qmsg.getCommonValue(idxUpcoming).split(",", QString::SkipEmptyParts);
+#endif
+    }
+    Q_EMIT prefetchHint(rm.from, rm.qmsg, at, upcoming);
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (at <= now && mScheduled.empty())
+        return false; // late, and nothing to keep the order with
+
+    const qint64 due = std::min(at, now + SCHEDULE_MAX_DELAY_MS);
+    METLIBS_LOG_DEBUG("delivering '" << rm.qmsg.command() << "' in " << (due - now) << "ms");
+    mScheduled.insert(std::make_pair(due, rm));
+    scheduleDeliveryTimer();
+    return true;
+}
+
+void CoClient::scheduleDeliveryTimer()
+{
+    if (mScheduled.empty()) {
+        mScheduleTimer->stop();
+        return;
+    }
+    const qint64 wait = mScheduled.begin()->first - QDateTime::currentMSecsSinceEpoch();
+    mScheduleTimer->start(int(std::max(wait, qint64(0))));
+}
+
+void CoClient::deliverScheduled()
+{
+    METLIBS_LOG_SCOPE();
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    ReceivedMessages due;
+    while (!mScheduled.empty()
+            && (!mScheduledDelivery || mScheduled.begin()->first <= now))
+    {
+        due << mScheduled.begin()->second;
+        mScheduled.erase(mScheduled.begin());
+    }
+    scheduleDeliveryTimer();
+
+    ReceivedMessages batch;
+    for (int i = 0; i < due.size(); ++i) {
+        const ReceivedMessage& rm = due.at(i);
+        invalidateResponses(rm.from, rm.qmsg.command());
+        if (dispatchToHandlers(rm.from, rm.qmsg))
+            continue;
+        if (mBatchedDelivery)
+            batch << rm;
+        else
+            emitMessage(rm.from, rm.qmsg);
+    }
+    if (!batch.isEmpty())
+        Q_EMIT receivedMessages(batch);
+}
+
+void CoClient::scheduleRequestTimer()
+{
+    if (mRequests.empty()) {
+        mRequestTimer->stop();
+        return;
+    }
+    qint64 first = mRequests.front().deadline;
+    for (requests_t::const_iterator it = mRequests.begin(); it != mRequests.end(); ++it)
+        first = std::min(first, it->deadline);
+    mRequestTimer->start(int(std::max(first - mClock.elapsed(), qint64(0))));
+}
+
+void CoClient::expireRequests()
+{
+    METLIBS_LOG_SCOPE();
+    const qint64 now = mClock.elapsed();
+    requests_t expired;
+    requests_t::iterator next = mRequests.begin();
+    while (next != mRequests.end()) {
+        requests_t::iterator it = next++;
+        if (it->deadline <= now)
+            expired.splice(expired.end(), mRequests, it);
+    }
+    scheduleRequestTimer();
 
-    Q_EMIT disconnected();
-    destroySocket();
+    for (requests_t::const_iterator it = expired.begin(); it != expired.end(); ++it) {
+        METLIBS_LOG_INFO("request " << it->id << " timed out");
+        it->handler(false, it->to, miQMessage());
+    }
 }
 
-void CoClient::readNew()
+void CoClient::failRequests(int toId)
 {
-    METLIBS_LOG_SCOPE();
-    int from;
-    ClientIds to;
-    miQMessage qmsg;
-    while (io->read(from, to, qmsg)) {
-        bool send = true;
-        if (from == 0)
-            send = messageFromServer(qmsg);
-        if (send)
-            emitMessage(from, qmsg);
+    requests_t failed;
+    requests_t::iterator next = mRequests.begin();
+    while (next != mRequests.end()) {
+        requests_t::iterator it = next++;
+        if (toId == qmstrings::all || it->to == toId)
+            failed.splice(failed.end(), mRequests, it);
+    }
+    if (failed.empty())
+        return;
+    scheduleRequestTimer();
+
+    for (requests_t::const_iterator it = failed.begin(); it != failed.end(); ++it) {
+        METLIBS_LOG_INFO("request " << it->id << " failed, receiver gone");
+        it->handler(false, it->to, miQMessage());
     }
 }
 
@@ -563,35 +2312,259 @@ void CoClient::setSelectedPeerNames(const QStringList& names)
     sendSetPeers();
 }
 
+void CoClient::setRetainedCommands(const QStringList& commands)
+{
+    mRetainedCommands = commands;
+    retained_t::iterator next = mRetained.begin();
+    while (next != mRetained.end()) {
+        retained_t::iterator it = next++;
+        if (!mRetainedCommands.contains(it->first))
+            mRetained.erase(it);
+    }
+}
+
+void CoClient::sendRetained(int toId)
+{
+    METLIBS_LOG_SCOPE(LOGVAL(toId));
+    clients_t::const_iterator c = clients.find(toId);
+    if (mRetained.empty() || c == clients.end())
+        return;
+    // a broadcast would not have reached peers that are not selected
+    if (!mSelectedPeerNames.isEmpty() && !mSelectedPeerNames.contains(c->second.name))
+        return;
+    for (retained_t::const_iterator it = mRetained.begin(); it != mRetained.end(); ++it) {
+        METLIBS_LOG_DEBUG("replaying '" << it->first << "' to client " << toId);
+        sendMessage(it->second, clientId(toId));
+    }
+}
+
 void CoClient::sendSetPeers()
 {
     METLIBS_LOG_SCOPE();
     miQMessage setpeers("SETPEERS");
     setpeers.addDataDesc("peer_ids");
+    mPeerIds.clear();
     for (clients_t::const_iterator it = clients.begin(); it != clients.end(); ++it) {
-        if (mSelectedPeerNames.isEmpty() || mSelectedPeerNames.contains(it->second.name))
-            setpeers.addDataValues(QStringList(QString::number(it->first)));
+        if (mSelectedPeerNames.isEmpty() || mSelectedPeerNames.contains(it->second.name)) {
+            setpeers.addDataValues(QStringList(QString::number(serverId(it->first))));
+            mPeerIds.insert(it->first);
+        }
     }
     sendMessageToServer(setpeers);
 }
 
+void CoClient::subscribe(const QStringList& commands)
+{
+    METLIBS_LOG_SCOPE(LOGVAL(commands.join(",")));
+    const bool wasEnabled = !mSubscriptions.isEmpty();
+    mSubscriptions = commands;
+    mSubscriptions.removeDuplicates();
+    if (wasEnabled || !mSubscriptions.isEmpty()) {
+        sendSubscriptions();
+        sendStandbySubscriptions();
+    }
+}
+
+void CoClient::sendSubscriptions()
+{
+    METLIBS_LOG_SCOPE();
+    if (!isConnected() || mId < 0)
+        return;
+    sendMessageToServer(subscriptionsMessage());
+}
+
+miQMessage CoClient::subscriptionsMessage() const
+{
+    // also sent with an empty list, to receive everything again
+    miQMessage setsubscriptions("SETSUBSCRIPTIONS");
+    setsubscriptions.addDataDesc("commands");
+    for (QStringList::const_iterator it = mSubscriptions.begin(); it != mSubscriptions.end(); ++it)
+        setsubscriptions.addDataValues(QStringList(*it));
+    return setsubscriptions;
+}
+
+bool CoClient::isSubscribed(const QString& command) const
+{
+    return mSubscriptions.isEmpty() || mSubscriptions.contains(command);
+}
+
+void CoClient::setViewport(double latMin, double latMax, double lonMin, double lonMax)
+{
+    mHasViewport = true;
+    mViewport = Viewport(latMin, latMax, lonMin, lonMax);
+    sendViewport(ClientIds());
+}
+
+void CoClient::clearViewport()
+{
+    if (!mHasViewport)
+        return;
+    mHasViewport = false;
+    sendViewport(ClientIds());
+}
+
+void CoClient::sendViewport(const ClientIds& to)
+{
+    METLIBS_LOG_SCOPE();
+    ClientIds receivers = to;
+    if (receivers.empty()) {
+        // all peers, not only the selected ones, may send to this client
+        for (clients_t::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+            if (it->second.connected)
+                receivers.insert(it->first);
+        }
+        if (receivers.empty())
+            return;
+    }
+
+    miQMessage viewport(qmstrings::viewport);
+    if (mHasViewport) {
+        viewport.addCommon("lat_min", QString::number(mViewport.latMin, 'g', 10));
+        viewport.addCommon("lat_max", QString::number(mViewport.latMax, 'g', 10));
+        viewport.addCommon("lon_min", QString::number(mViewport.lonMin, 'g', 10));
+        viewport.addCommon("lon_max", QString::number(mViewport.lonMax, 'g', 10));
+    }
+    sendMessage(viewport, receivers);
+}
+
+bool CoClient::handleViewport(int fromId, const miQMessage& qmsg)
+{
+    if (qmsg.command() != qmstrings::viewport)
+        return false;
+
+    bool ok[4] = { false, false, false, false };
+    const Viewport v(qmsg.getCommonValue("lat_min").toDouble(&ok[0]),
+            qmsg.getCommonValue("lat_max").toDouble(&ok[1]),
+            qmsg.getCommonValue("lon_min").toDouble(&ok[2]),
+            qmsg.getCommonValue("lon_max").toDouble(&ok[3]));
+    const viewports_t::iterator previous = mPeerViewports.find(fromId);
+    // without a viewport before, the peer has received all rows already
+    const bool changed = (previous != mPeerViewports.end())
+            && !(ok[0] && ok[1] && ok[2] && ok[3] && previous->second == v);
+    if (ok[0] && ok[1] && ok[2] && ok[3]) {
+        METLIBS_LOG_DEBUG("viewport of client " << fromId << " lat " << v.latMin << ".." << v.latMax
+                << " lon " << v.lonMin << ".." << v.lonMax);
+        mPeerViewports[fromId] = v;
+    } else {
+        METLIBS_LOG_DEBUG("client " << fromId << " has no viewport");
+        mPeerViewports.erase(fromId);
+    }
+
+    if (changed) {
+        // rows filtered out before may be inside the new viewport
+        for (retained_t::const_iterator it = mFilteredLast.begin(); it != mFilteredLast.end(); ++it) {
+            METLIBS_LOG_DEBUG("re-sending '" << it->first << "' to client " << fromId);
+            sendStamped(unstamped(it->second), clientId(fromId));
+        }
+    }
+    return true;
+}
+
+void CoClient::setSpatialFiltering(const QString& command, const QString& latColumn,
+        const QString& lonColumn)
+{
+    mSpatialFilters[command] = std::make_pair(latColumn, lonColumn);
+}
+
+void CoClient::removeSpatialFiltering(const QString& command)
+{
+    mSpatialFilters.erase(command);
+    mFilteredLast.erase(command);
+}
+
+bool CoClient::sendSpatiallyFiltered(const miQMessage& qmsg, const ClientIds& to)
+{
+    spatial_filters_t::const_iterator filter = mSpatialFilters.find(qmsg.command());
+    if (filter == mSpatialFilters.end())
+        return false;
+    const int latColumn = qmsg.findDataDesc(filter->second.first);
+    const int lonColumn = qmsg.findDataDesc(filter->second.second);
+    if (latColumn < 0 || lonColumn < 0)
+        return false;
+
+    ClientIds receivers = to;
+    if (receivers.empty()) {
+        // the peers the server would send a broadcast to
+        for (ClientIds::const_iterator it = mPeerIds.begin(); it != mPeerIds.end(); ++it) {
+            clients_t::const_iterator c = clients.find(*it);
+            if (c != clients.end() && c->second.connected)
+                receivers.insert(*it);
+        }
+    }
+
+    ClientIds unfiltered, filtered;
+    for (ClientIds::const_iterator it = receivers.begin(); it != receivers.end(); ++it) {
+        if (mPeerViewports.find(*it) != mPeerViewports.end())
+            filtered.insert(*it);
+        else
+            unfiltered.insert(*it);
+    }
+    if (filtered.empty())
+        return false;
+
+    if (!unfiltered.empty())
+        enqueueMessage(qmsg, unfiltered);
+
+    const coclient::RowGrid grid(qmsg, latColumn, lonColumn);
+    for (ClientIds::const_iterator it = filtered.begin(); it != filtered.end(); ++it) {
+        const Viewport& v = mPeerViewports[*it];
+        const std::vector<int> rows = grid.select(v.latMin, v.latMax, v.lonMin, v.lonMax);
+        QList<QStringList> values;
+        values.reserve(rows.size());
+        for (std::vector<int>::const_iterator r = rows.begin(); r != rows.end(); ++r)
+            values << qmsg.getDataValues(*r);
+        METLIBS_LOG_DEBUG("sending " << values.size() << " of " << qmsg.countDataRows()
+                << " '" << qmsg.command() << "' rows to client " << *it);
+
+        miQMessage subset(qmsg.command());
+        subset.setCommon(qmsg.getCommonDesc(), qmsg.getCommonValues());
+        subset.setData(qmsg.getDataDesc(), values);
+        enqueueMessage(subset, clientId(*it));
+    }
+    return true;
+}
+
 bool CoClient::messageFromServer(const miQMessage& qmsg)
 {
     METLIBS_LOG_SCOPE(LOGVAL(qmsg.command()));
 
-    if (qmsg.command() == qmstrings::registeredclient) {
+    // the names are compared, too, to be safe against hash collisions
+    const QString& command = qmsg.command();
+    switch (qmstrings::command_hash(command)) {
+    case qmstrings::ids::registeredclient:
+        if (command != qmstrings::registeredclient)
+            break;
         handleRegisteredClient(qmsg);
-    } else if (qmsg.command() == qmstrings::newclient) {
+        return true;
+    case qmstrings::ids::newclient:
+        if (command != qmstrings::newclient)
+            break;
         handleNewClient(qmsg);
-    } else if (qmsg.command() == qmstrings::renameclient) {
+        return true;
+    case qmstrings::ids::renameclient:
+        if (command != qmstrings::renameclient)
+            break;
         handleRenameClient(qmsg);
-    } else if (qmsg.command() == qmstrings::removeclient) {
+        return true;
+    case qmstrings::ids::removeclient:
+        if (command != qmstrings::removeclient)
+            break;
         handleRemoveClient(qmsg);
-    } else if (qmsg.command() == qmstrings::unregisteredclient) {
+        return true;
+    case qmstrings::ids::unregisteredclient:
+        if (command != qmstrings::unregisteredclient)
+            break;
         handleUnregisteredClient(qmsg);
-    } else {
-        METLIBS_LOG_ERROR("Error editing client list, unknown command '" << qmsg.command() << "'");
+        return true;
+    case qmstrings::ids::pong:
+        if (command != qmstrings::pong)
+            break;
+        handlePong(qmsg);
+        return false;
+    default:
+        break;
     }
+    METLIBS_LOG_ERROR("Error editing client list, unknown command '" << command << "'");
     return true;
 }
 
@@ -600,13 +2573,25 @@ void CoClient::handleRegisteredClient(const miQMessage& qmsg)
     METLIBS_LOG_SCOPE();
 
     // this client's id is sent in the first message from the server
+    bool registered = false, resumed = false;
     const int idxMyId = qmsg.findCommonDesc("id");
     if (idxMyId >= 0) {
         bool idOk = false;
         const int myId = qmsg.getCommonValue(idxMyId).toInt(&idOk);
         if (idOk) {
+            resumed = !mSessionToken.isEmpty() && myId == mSessionId
+                    && qmsg.getCommonValue(qmstrings::resumed) == "1";
+            if (resumed) {
+                METLIBS_LOG_INFO("resumed session");
+                mSessionTimer->stop();
+            } else if (!mSessionToken.isEmpty()) {
+                forgetClients();
+            }
+            mSessionToken = qmsg.getCommonValue(qmstrings::session);
+            mSessionId = myId;
             mId = myId;
             METLIBS_LOG_DEBUG("received my id " << mId);
+            registered = true;
             Q_EMIT receivedId(mId);
         } else {
             METLIBS_LOG_WARN("could not parse id from '" << qmsg.getCommonValue(idxMyId) << "'");
@@ -620,21 +2605,34 @@ void CoClient::handleRegisteredClient(const miQMessage& qmsg)
     if (idxId >= 0 && idxName >= 0 && idxType >= 0) {
         for (int i=0; i<qmsg.countDataRows(); ++i) {
             const QString& pIdText = qmsg.getDataValue(i, idxId);
-            const int pId = pIdText.toInt();
+            const int pId = localId(pIdText.toInt());
             const QString& pName = qmsg.getDataValue(i, idxName);
             const QString& pType = qmsg.getDataValue(i, idxType);
 
             clients_t::iterator it = clients.find(pId);
             if (it == clients.end()) {
-                clients.insert(std::make_pair(pId, Client(pType, pName)));
+                clients.insert(std::make_pair(pId, Client(pType, pName, !registered)));
                 METLIBS_LOG_DEBUG("registered client " << pId << " of type " << pType);
                 Q_EMIT clientChange(pId, CLIENT_REGISTERED);
+            } else if (resumed) {
+                // known from before resuming the session
+                it->second.type = pType;
+                it->second.name = pName;
             } else {
                 METLIBS_LOG_WARN("bad registered message for known client " << pId);
             }
         }
         sendSetPeers();
     }
+
+    if (registered) {
+        if (mCreditMessages > 0 || mCreditBytes > 0)
+            sendCredits(true);
+        if (!mSubscriptions.isEmpty())
+            sendSubscriptions();
+        // send buffered messages after SETPEERS
+        releaseHeldMessages();
+    }
 }
 
 void CoClient::handleUnregisteredClient(const miQMessage& qmsg)
@@ -644,12 +2642,13 @@ void CoClient::handleUnregisteredClient(const miQMessage& qmsg)
     if (idxId >= 0 && qmsg.countDataRows() > 0) {
         for (int i=0; i<qmsg.countDataRows(); ++i) {
             const QString& pIdText = qmsg.getDataValue(i, idxId);
-            const int pId = pIdText.toInt();
+            const int pId = localId(pIdText.toInt());
 
             clients_t::iterator it = clients.find(pId);
             if (it != clients.end()) {
                 Q_EMIT clientChange(pId, CLIENT_UNREGISTERED);
                 clients.erase(pId);
+                forgetPeer(pId);
                 METLIBS_LOG_DEBUG("unregistered client " << pId);
             } else {
                 METLIBS_LOG_WARN("bad unregistered message for client " << pId);
@@ -663,11 +2662,15 @@ void CoClient::handleNewClient(const miQMessage& qmsg)
 {
     METLIBS_LOG_SCOPE();
 
-    const int id = qmsg.getCommonValue("id").toInt();
+    const int id = localId(qmsg.getCommonValue("id").toInt());
     clients_t::iterator it = clients.find(id);
     if (it != clients.end() && !it->second.connected) {
         METLIBS_LOG_DEBUG("connected with client " << id);
         it->second.connected = true;
+        if (mHasViewport)
+            sendViewport(clientId(id));
+        if (it->second.late)
+            sendRetained(id);
         Q_EMIT clientChange(id, CLIENT_NEW);
         Q_EMIT newClient(it->second.type);
         Q_EMIT newClient(it->second.type.toStdString());
@@ -681,11 +2684,14 @@ void CoClient::handleRemoveClient(const miQMessage& qmsg)
 {
     METLIBS_LOG_SCOPE();
 
-    const int id = qmsg.getCommonValue("id").toInt();
+    const int id = localId(qmsg.getCommonValue("id").toInt());
     clients_t::iterator it = clients.find(id);
     if (it != clients.end() && it->second.connected) {
         it->second.connected = false;
         METLIBS_LOG_DEBUG("diconnected from client " << id);
+        failRequests(id);
+        invalidateResponses(id, QString());
+        mPeerViewports.erase(id);
 
         Q_EMIT clientChange(id, CLIENT_GONE);
         Q_EMIT newClient(std::string("myself"));
@@ -699,7 +2705,7 @@ void CoClient::handleRenameClient(const miQMessage& qmsg)
 {
     METLIBS_LOG_SCOPE();
 
-    const int id = qmsg.getCommonValue("id").toInt();
+    const int id = localId(qmsg.getCommonValue("id").toInt());
     const QString name = qmsg.getCommonValue("name");
 
     clients_t::iterator it = clients.find(id);
@@ -724,27 +2730,66 @@ void CoClient::handleRenameClient(const miQMessage& qmsg)
 void CoClient::connectionEstablished()
 {
     METLIBS_LOG_SCOPE();
+    if (!isCurrentConnection())
+        return;
+    startSession();
+}
+
+void CoClient::startSession()
+{
+    METLIBS_LOG_SCOPE();
+    mConnectionState = CONNECTED;
+    mRaceFailed = false;
+    mHeartbeatOutstanding = 0;
+    mPingsSent.clear();
+    mSmoothedRtt8 = -1;
+    if (mHeartbeatTimer->interval() > 0)
+        mHeartbeatTimer->start();
+    mReconnectAttempts = 0;
+    stopWaitingForServer();
     METLIBS_LOG_INFO("start talking to '" << getConnectedServerUrl().toString() << "'");
+    if (mRaceStaggerMs > 0)
+        saveLastServer(getConnectedServerUrl());
 
-    QIODevice* device = tcpSocket ? static_cast<QIODevice*>(tcpSocket) : static_cast<QIODevice*>(localSocket);
-    if (!device)
-        return;
-    io.reset(new miMessageIO(device, false));
+    mConsumedMessages = 0;
+    mConsumedBytes = 0;
 
     sendClientType();
+    if (isPipelining()) {
+        // without SETPEERS to wait for, buffered messages follow SETTYPE
+        for (outgoing_t::iterator it = mOutgoing.begin(); it != mOutgoing.end(); ++it)
+            it->held = false;
+    }
+    if (mHotStandby)
+        scheduleStandby(0);
     Q_EMIT connected();
 }
 
-void CoClient::sendClientType()
+miQMessage CoClient::clientTypeMessage() const
 {
-    METLIBS_LOG_SCOPE();
     miQMessage qmsg("SETTYPE");
     qmsg.addCommon("type", clientType);
     qmsg.addCommon("userId", userid);
     qmsg.addCommon("name", name);
     qmsg.addCommon("protocolVersion", 1);
+    return qmsg;
+}
 
-    sendMessageToServer(qmsg);
+void CoClient::sendClientType()
+{
+    METLIBS_LOG_SCOPE();
+    miQMessage qmsg = clientTypeMessage();
+    if (!mSessionToken.isEmpty()) {
+        qmsg.addCommon(qmstrings::resume_session, mSessionToken);
+        qmsg.addCommon(qmstrings::resume_id, mSessionId);
+        // the server decides now; keep the token and peers for its reply
+        mSessionTimer->stop();
+    }
+
+    // SETTYPE must be ahead of messages queued while connecting
+    enqueueMessage(qmsg, clientId(0), true);
+    scheduleFlush();
+    checkSendQueueFull();
 }
 
 void CoClient::sendMessageToServer(const miQMessage& qmsg)
@@ -754,9 +2799,6 @@ void CoClient::sendMessageToServer(const miQMessage& qmsg)
 
 bool CoClient::sendMessage(const miMessage &msg)
 {
-    if (!isConnected())
-        return false;
-
     int from, to;
     miQMessage qmsg;
     convert(msg, from, to, qmsg);
@@ -769,22 +2811,319 @@ bool CoClient::sendMessage(const miMessage &msg)
 bool CoClient::sendMessage(const miQMessage& qmsg, const ClientIds& to)
 {
     METLIBS_LOG_SCOPE(qmsg);
-    if (!isConnected())
-        return false;
+    if (mHotStandby && to.empty()) {
+        // the same message may arrive through both servers
+        miQMessage stamped(qmsg);
+        stamped.addCommon(qmstrings::origin, mOrigin);
+        stamped.addCommon(qmstrings::origin_seq, QString::number(++mOriginSeq));
+        return sendStamped(stamped, to);
+    }
+    return sendStamped(qmsg, to);
+}
+
+bool CoClient::sendStamped(const miQMessage& qmsg, const ClientIds& to)
+{
+    if (to.empty() && !mRetainedCommands.isEmpty() && mRetainedCommands.contains(qmsg.command()))
+        mRetained[qmsg.command()] = qmsg;
+    if (to.empty() && mSpatialFilters.count(qmsg.command()))
+        mFilteredLast[qmsg.command()] = qmsg;
+
+    if (!isConnected()) {
+        const bool connecting = isPipelining() && !notConnected();
+        if ((mOfflineMaxMessages <= 0 && !connecting) || !to.empty())
+            return false;
+        METLIBS_LOG_DEBUG("buffering message while not connected");
+        enqueueMessage(qmsg, to);
+        if (mOfflineMaxMessages > 0)
+            limitOfflineMessages();
+        checkSendQueueFull();
+        return true;
+    }
 
-    METLIBS_LOG_DEBUG(LOGVAL(mId) << " protocolVersion=" << io->protocolVersion());
+    METLIBS_LOG_DEBUG(LOGVAL(mId));
 
-    io->write(-1 /*ignored*/, to, qmsg);
-    if (tcpSocket)
-        tcpSocket->waitForBytesWritten(250);
-    else if (localSocket)
-        localSocket->waitForBytesWritten(250);
+    // messages are collected and written to the socket together at the
+    // end of this event loop iteration; do not block here waiting for a
+    // slow peer
+    if (mPeerViewports.empty() || !sendSpatiallyFiltered(qmsg, to))
+        enqueueMessage(qmsg, to);
+    scheduleFlush();
+    checkSendQueueFull();
     return true;
 }
 
+void CoClient::postMessage(const miQMessage& qmsg, const ClientIds& to)
+{
+    mPosted->push(qmsg, to);
+    // only the first message after sendPosted() started needs a wakeup
+    if (!mPostedScheduled.exchange(true, std::memory_order_acq_rel))
+        QMetaObject::invokeMethod(this, "sendPosted", Qt::QueuedConnection);
+}
+
+void CoClient::sendPosted()
+{
+    METLIBS_LOG_SCOPE();
+    // reset first; a message pushed after this will schedule another call
+    mPostedScheduled.store(false, std::memory_order_release);
+    ClientIds to;
+    miQMessage qmsg;
+    while (mPosted->pop(to, qmsg)) {
+        if (!sendMessage(qmsg, to))
+            METLIBS_LOG_DEBUG("dropping posted '" << qmsg.command() << "' message");
+    }
+}
+
+void CoClient::setSendConflation(const QString& command, const QString& commonField, int ttl)
+{
+    removeSendConflation(command);
+    mSendConflation.insert(std::make_pair(command, ConflationRule(commonField, ttl)));
+}
+
+void CoClient::removeSendConflation(const QString& command)
+{
+    mSendConflation.erase(command);
+}
+
+void CoClient::enqueueMessage(const miQMessage& qmsg, const ClientIds& to, bool front)
+{
+    OutgoingMessage om;
+    om.qmsg = qmsg;
+    om.to = to;
+    om.expires = 0;
+    om.size = estimatedSize(qmsg, to);
+    // with offline buffering, messages to peers wait until registration is complete
+    om.held = (mOfflineMaxMessages > 0 && mId < 0 && to.empty() && !isPipelining());
+
+    conflation_t::const_iterator rule = mSendConflation.find(qmsg.command());
+    if (rule != mSendConflation.end()) {
+        om.key = conflationKey(qmsg, rule->second.commonField) + receiversKey(to);
+        if (rule->second.ttl > 0)
+            om.expires = mClock.elapsed() + rule->second.ttl;
+
+        // the replacement is queued anew, after messages sent in between
+        outgoing_keys_t::iterator k = mOutgoingKeys.find(om.key);
+        if (k != mOutgoingKeys.end()) {
+            METLIBS_LOG_DEBUG("replacing queued '" << qmsg.command() << "' message");
+            eraseOutgoing(k->second);
+        }
+    }
+
+    outgoing_t::iterator queued;
+    if (front) {
+        mOutgoing.push_front(om);
+        queued = mOutgoing.begin();
+    } else {
+        mOutgoing.push_back(om);
+        queued = --mOutgoing.end();
+    }
+    mOutgoingBytes += om.size;
+    if (!om.key.isEmpty())
+        mOutgoingKeys[om.key] = queued;
+}
+
+void CoClient::eraseOutgoing(outgoing_t::iterator it)
+{
+    if (!it->key.isEmpty())
+        mOutgoingKeys.erase(it->key);
+    mOutgoingBytes -= it->size;
+    mOutgoing.erase(it);
+}
+
+void CoClient::writeOutgoing(bool all)
+{
+    METLIBS_LOG_SCOPE(LOGVAL(mOutgoing.size()));
+    if (!mConnection)
+        return;
+    const qint64 now = mClock.elapsed();
+    const qint64 unsentBefore = mConnection->bytesUnsent();
+    CoConnection::Messages messages;
+    qint64 messagesBytes = 0;
+    outgoing_t::iterator next = mOutgoing.begin();
+    while (next != mOutgoing.end()) {
+        outgoing_t::iterator it = next++;
+        if (it->expires > 0 && it->expires <= now) {
+            METLIBS_LOG_DEBUG("dropping expired '" << it->qmsg.command() << "' message");
+            eraseOutgoing(it);
+            continue;
+        }
+        if (it->held)
+            continue;
+        if (!all) {
+            // while the socket is busy, keep messages in the queue where
+            // they may still be conflated
+            const qint64 unsent = unsentBefore + messagesBytes;
+            if (unsent > 0 && unsent >= mSendQueueLow)
+                break;
+        }
+        messages << CoConnection::Message(serverIds(it->to), it->qmsg);
+        messagesBytes += it->size;
+        eraseOutgoing(it);
+    }
+    if (!messages.isEmpty()) {
+        mConnection->addInTransit(messagesBytes);
+        QMetaObject::invokeMethod(mConnection, "send",
+                Q_ARG(CoConnection::Messages, messages), Q_ARG(qint64, messagesBytes));
+
+        if (mStandby && mStandbyId >= 0) {
+            // ids differ between servers, only messages to all peers are mirrored
+            CoConnection::Messages broadcasts;
+            for (CoConnection::Messages::const_iterator it = messages.begin(); it != messages.end(); ++it) {
+                if (it->to.empty())
+                    broadcasts << *it;
+            }
+            if (!broadcasts.isEmpty())
+                sendThrough(mStandby, broadcasts);
+        }
+    }
+}
+
+void CoClient::setOfflineBuffer(int maxMessages, qint64 maxBytes)
+{
+    mOfflineMaxMessages = std::max(maxMessages, 0);
+    mOfflineMaxBytes = std::max(maxBytes, qint64(0));
+    if (!isConnected()) {
+        keepOfflineMessages();
+        checkSendQueueDrained();
+    }
+}
+
+void CoClient::setPipelinedHandshake(bool pipelined)
+{
+    mPipelinedHandshake = pipelined;
+}
+
+bool CoClient::isPipelining() const
+{
+    return mPipelinedHandshake && mSelectedPeerNames.isEmpty();
+}
+
+void CoClient::keepOfflineMessages()
+{
+    // messages to the server or to specific clients are useless after
+    // reconnecting, as client ids change
+    outgoing_t::iterator next = mOutgoing.begin();
+    while (next != mOutgoing.end()) {
+        outgoing_t::iterator it = next++;
+        if (mOfflineMaxMessages > 0 && it->to.empty())
+            it->held = true;
+        else
+            eraseOutgoing(it);
+    }
+    limitOfflineMessages();
+}
+
+void CoClient::limitOfflineMessages()
+{
+    const qint64 now = mClock.elapsed();
+    outgoing_t::iterator next = mOutgoing.begin();
+    while (next != mOutgoing.end()) {
+        outgoing_t::iterator it = next++;
+        if (it->expires > 0 && it->expires <= now)
+            eraseOutgoing(it);
+    }
+
+    while (!mOutgoing.empty()
+            && (int(mOutgoing.size()) > mOfflineMaxMessages
+                    || (mOfflineMaxBytes > 0 && mOutgoingBytes > mOfflineMaxBytes)))
+    {
+        METLIBS_LOG_DEBUG("offline buffer full, dropping '" << mOutgoing.front().qmsg.command() << "' message");
+        eraseOutgoing(mOutgoing.begin());
+    }
+}
+
+void CoClient::releaseHeldMessages()
+{
+    METLIBS_LOG_SCOPE();
+    // move held messages behind the messages to the server queued during
+    // registration (SETPEERS), keeping their order
+    outgoing_t held;
+    outgoing_t::iterator next = mOutgoing.begin();
+    while (next != mOutgoing.end()) {
+        outgoing_t::iterator it = next++;
+        if (it->held) {
+            it->held = false;
+            held.splice(held.end(), mOutgoing, it);
+        }
+    }
+    mOutgoing.splice(mOutgoing.end(), held);
+    if (!mOutgoing.empty())
+        scheduleFlush();
+}
+
+void CoClient::scheduleFlush()
+{
+    if (!mFlushScheduled) {
+        mFlushScheduled = true;
+        QTimer::singleShot(0, this, SLOT(flushScheduled()));
+    }
+}
+
+void CoClient::flushScheduled()
+{
+    if (mFlushScheduled)
+        flush();
+}
+
+void CoClient::flush()
+{
+    METLIBS_LOG_SCOPE();
+    mFlushScheduled = false;
+    if (!isConnected())
+        return;
+    writeOutgoing(false);
+}
+
+qint64 CoClient::bytesPending() const
+{
+    qint64 pending = mOutgoingBytes;
+    if (mConnection)
+        pending += mConnection->bytesUnsent();
+    return pending;
+}
+
+void CoClient::setSendQueueWatermarks(qint64 high, qint64 low)
+{
+    mSendQueueHigh = std::max(high, qint64(1));
+    mSendQueueLow = std::min(std::max(low, qint64(0)), mSendQueueHigh);
+    checkSendQueueFull();
+    checkSendQueueDrained();
+}
+
+void CoClient::checkSendQueueFull()
+{
+    if (!mSendQueueFull && bytesPending() > mSendQueueHigh) {
+        METLIBS_LOG_DEBUG("send queue full, " << bytesPending() << " bytes pending");
+        mSendQueueFull = true;
+        Q_EMIT sendQueueFull();
+    }
+}
+
+void CoClient::checkSendQueueDrained()
+{
+    if (mSendQueueFull && bytesPending() <= mSendQueueLow) {
+        METLIBS_LOG_DEBUG("send queue drained, " << bytesPending() << " bytes pending");
+        mSendQueueFull = false;
+        Q_EMIT sendQueueDrained();
+    }
+}
+
+void CoClient::connectionBytesWritten()
+{
+    if (!isCurrentConnection())
+        return;
+    if (!mOutgoing.empty())
+        scheduleFlush();
+    checkSendQueueDrained();
+}
+
 void CoClient::tcpError(QAbstractSocket::SocketError e)
 {
     METLIBS_LOG_SCOPE();
+    if (!isCurrentConnection())
+        return;
+    if (promoteStandby())
+        return;
+    mConnectionState = UNCONNECTED;
     if (QAbstractSocket::ConnectionRefusedError == e) {
         METLIBS_LOG_INFO("could not connect to tcp coserver");
         tryToStartOrConnectNext();
@@ -800,6 +3139,11 @@ void CoClient::tcpError(QAbstractSocket::SocketError e)
 void CoClient::localError(QLocalSocket::LocalSocketError e)
 {
     METLIBS_LOG_SCOPE();
+    if (!isCurrentConnection())
+        return;
+    if (promoteStandby())
+        return;
+    mConnectionState = UNCONNECTED;
     if (QLocalSocket::ConnectionRefusedError == e || QLocalSocket::ServerNotFoundError == e) {
         METLIBS_LOG_INFO("could not connect to local coserver");
         tryToStartOrConnectNext();
@@ -812,10 +3156,37 @@ void CoClient::localError(QLocalSocket::LocalSocketError e)
     }
 }
 
+void CoClient::setReconnectBackoff(int firstMs, int initialMs, int maxMs, double factor, double jitter)
+{
+    mReconnectFirstMs = std::max(firstMs, 0);
+    mReconnectInitialMs = std::max(initialMs, 1);
+    mReconnectMaxMs = std::max(maxMs, mReconnectInitialMs);
+    mReconnectFactor = std::max(factor, 1.0);
+    mReconnectJitter = std::min(std::max(jitter, 0.0), 1.0);
+}
+
+int CoClient::reconnectDelay()
+{
+    const double delay = coclient::backoffDelay(mReconnectAttempts++, mReconnectFirstMs,
+            mReconnectInitialMs, mReconnectMaxMs, mReconnectFactor);
+
+    static std::mt19937 random((std::random_device())());
+    std::uniform_real_distribution<double> fraction(0, 1);
+    return coclient::jitteredDelay(delay, mReconnectJitter, fraction(random));
+}
+
 void CoClient::tryReconnectAfterTimeout()
 {
     METLIBS_LOG_SCOPE();
-    QTimer::singleShot(TIMEOUT_RECONNECT_MS, this, SLOT(connectServer()));
+    if (isWaitingForServer()) {
+        // a server is starting, connect as soon as it listens
+        mReconnectTimer->start(SERVER_POLL_MS);
+        return;
+    }
+    const int delay = reconnectDelay();
+    METLIBS_LOG_INFO("reconnecting in " << delay << "ms, attempt " << mReconnectAttempts);
+    // restarting the timer avoids piling up reconnects
+    mReconnectTimer->start(delay);
 }
 
 void CoClient::tryConnectNextServer()
@@ -823,12 +3194,15 @@ void CoClient::tryConnectNextServer()
     METLIBS_LOG_SCOPE();
     serverIndex += 1;
     serverStarting = -1;
+    stopWaitingForServer();
     connectServer();
 }
 
 void CoClient::tryToStartOrConnectNext()
 {
-    if (!tryToStartCoServer())
+    if (isWaitingForServer())
+        tryReconnectAfterTimeout();
+    else if (!tryToStartCoServer())
         tryConnectNextServer();
 }
 
@@ -861,6 +3235,18 @@ bool CoClient::tryToStartCoServer()
 
     serverStarting = serverIndex;
 
+    // only one of several clients started together runs the server
+    const QString lockName = QString("coserver-start-%1.lock")
+            .arg(qHash(serverUrl.toString()), 8, 16, QChar('0'));
+    mServerStartLock.reset(new QLockFile(QDir(serverStartLockDir()).absoluteFilePath(lockName)));
+    mServerStartLock->setStaleLockTime(SERVER_START_TIMEOUT_MS);
+    if (!mServerStartLock->tryLock(0)) {
+        METLIBS_LOG_INFO("another client is starting the local coserver, waiting");
+        mServerStartLock.reset();
+        waitForServer(serverUrl);
+        return true;
+    }
+
     METLIBS_LOG_INFO("try starting local coserver...");
     QStringList args = QStringList("-d"); ///< -d for dynamicMode
     args << "-u" << serverUrl.toString(QUrl::RemovePassword);
@@ -868,15 +3254,57 @@ bool CoClient::tryToStartCoServer()
     METLIBS_LOG_DEBUG("starting command=\"" << serverCommand
             << "\" args=[" << joinArgs(args) << "]");
     if (QProcess::startDetached(serverCommand, args)) {
-        tryReconnectAfterTimeout();
+        waitForServer(serverUrl);
         return true;
     } else {
         METLIBS_LOG_ERROR("could not run server command=\"" << serverCommand
                 << "\" args=[" << joinArgs(args) << "]");
+        mServerStartLock.reset();
         return false;
     }
 }
 
+void CoClient::waitForServer(const QUrl& serverUrl)
+{
+    METLIBS_LOG_SCOPE();
+    mServerWaitDeadline = mClock.elapsed() + SERVER_START_TIMEOUT_MS;
+    if (serverUrl.scheme() == SCHEME_LOCAL) {
+        // a local server is ready when its socket appears
+        mServerPath = serverUrl.path();
+        if (!mServerWatcher) {
+            mServerWatcher = new QFileSystemWatcher(this);
+            connect(mServerWatcher, SIGNAL(directoryChanged(const QString&)),
+                    SLOT(serverPathChanged()));
+        }
+        mServerWatcher->addPath(QFileInfo(mServerPath).absolutePath());
+    }
+    // polling also covers tcp servers and a missed directory change
+    tryReconnectAfterTimeout();
+}
+
+bool CoClient::isWaitingForServer() const
+{
+    return mServerWaitDeadline > 0 && serverStarting == serverIndex
+            && mClock.elapsed() < mServerWaitDeadline;
+}
+
+void CoClient::stopWaitingForServer()
+{
+    mServerWaitDeadline = 0;
+    mServerStartLock.reset();
+    if (mServerWatcher && !mServerWatcher->directories().isEmpty())
+        mServerWatcher->removePaths(mServerWatcher->directories());
+    mServerPath.clear();
+}
+
+void CoClient::serverPathChanged()
+{
+    if (!mServerPath.isEmpty() && QFileInfo(mServerPath).exists() && notConnected()) {
+        METLIBS_LOG_DEBUG("server socket '" << mServerPath << "' appeared");
+        connectServer();
+    }
+}
+
 bool CoClient::isLocalServer(const QUrl& url)
 {
     if (url.scheme() == SCHEME_LOCAL)
@@ -885,7 +3313,7 @@ bool CoClient::isLocalServer(const QUrl& url)
         const QString& host = url.host();
         if (host.isEmpty() || host == "127.0.0.1" || host == "[::1]")
             return true;
-        if (host == LOCALHOST || host == QHostInfo::localHostName())
+        if (host == LOCALHOST || host == ClientConfig::instance().localHostName())
             return true;
     }
     return false;
@@ -30,17 +30,33 @@
 #define METLIBS_COSERVER_COCLIENT 1
 
 #include "miMessage.h"
+#include "QLetterCommands.h"
 
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QList>
 #include <QtCore/QString>
 #include <QtCore/QUrl>
+#include <QtCore/QVector>
 #include <QtNetwork/QLocalSocket>
 #include <QtNetwork/QTcpSocket>
 
+#include <atomic>
+#include <functional>
+#include <list>
 #include <map>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
-class miMessageIO;
+class CoConnection;
+class QFileSystemWatcher;
+class QLockFile;
+class QThread;
+class QTimer;
+
+namespace coclient {
+class DuplicateFilter;
+}
 
 class CoClient : public QObject
 {
@@ -48,6 +64,24 @@ class CoClient : public QObject
 public:
     typedef QList<QUrl> QUrlList;
 
+    struct ReceivedMessage {
+        int from;
+        miQMessage qmsg;
+        ReceivedMessage()
+            : from(-1) { }
+        ReceivedMessage(int f, const miQMessage& q)
+            : from(f), qmsg(q) { }
+    };
+
+    typedef QVector<ReceivedMessage> ReceivedMessages;
+
+    typedef std::function<void(int from, const miQMessage& qmsg)> MessageHandler;
+
+    /*! Called with the reply to a request; ok is false, with an empty
+     *  reply, if the request timed out or the connection was lost.
+     */
+    typedef std::function<void(bool ok, int from, const miQMessage& reply)> ReplyHandler;
+
 public:
     CoClient(const QString& clientType, QObject* parent=0);
     CoClient(const QString& clientType, const QString& host, quint16 port = 0, QObject* parent = 0);
@@ -62,6 +96,60 @@ public:
     void setAttemptToStartServer(bool start)
         { mAttemptToStartServer = start; }
 
+    /*! Configure waiting before reconnecting: firstMs before the first
+     *  retry, then initialMs growing by factor up to maxMs for each
+     *  further failed attempt. Each wait is shortened by a random
+     *  fraction up to jitter (0..1) so that clients do not retry in
+     *  lockstep. Defaults are read from client.ini.
+     */
+    void setReconnectBackoff(int firstMs, int initialMs, int maxMs, double factor, double jitter);
+
+    /*! If staggerMs > 0, connecting from the start of the server list
+     *  tries the servers in parallel, starting the next attempt after
+     *  staggerMs or when an attempt fails, and keeps the first
+     *  connection established. The last server connected to is
+     *  remembered across runs and tried first.
+     */
+    void setConnectRacing(int staggerMs)
+        { mRaceStaggerMs = std::max(staggerMs, 0); }
+
+    /*! If the server hands out a session token at registration, keep
+     *  the peer list for graceMs after losing the connection and ask
+     *  the server to resume the session when reconnecting. If it does,
+     *  this client keeps its id and peers do not see it leave. 0
+     *  disables resuming.
+     */
+    void setSessionResumeGrace(int graceMs)
+        { mSessionGraceMs = std::max(graceMs, 0); }
+
+    /*! Send PING to the server every intervalMs while connected, and
+     *  switch to the next server when missCount intervals pass without
+     *  PONG or any other data from the server. Requires a server
+     *  answering PING; intervalMs 0 disables heartbeats.
+     */
+    void setHeartbeat(int intervalMs, int missCount);
+
+    /*! Keep a second registered connection to the next server in
+     *  serverUrls as hot standby. Messages to all peers are sent through
+     *  both, tagged with origin and sequence number so that receivers
+     *  drop duplicates, and traffic switches to the standby without
+     *  reconnecting when the active connection is lost. Peers known
+     *  through both servers keep their ids when switching.
+     */
+    void setHotStandby(bool standby);
+
+    //! Smoothed round trip time to the server in ms, -1 if unknown.
+    int smoothedRtt() const
+        { return mSmoothedRtt8 < 0 ? -1 : (mSmoothedRtt8 + 4) >> 3; }
+
+    /*! If enabled, the socket and the encoding and decoding of messages
+     *  are handled by an internal thread; messages are still delivered
+     *  in the thread owning this CoClient. Takes effect when the next
+     *  connection is made.
+     */
+    void setUseIoThread(bool use)
+        { mUseIoThread = use; }
+
     const QString& getClientType() const
       { return clientType; }
 
@@ -80,6 +168,14 @@ public:
 
     void setServerUrls(const QUrlList& urls);
 
+    /*! If enabled, the server list is ordered by consistent hashing of
+     *  the user id instead of using the configured order, so that the
+     *  clients of one user use the same server and users are spread
+     *  over all servers. When a server fails, the next one on the hash
+     *  ring is used.
+     */
+    void setHashedServerPlacement(bool hashed);
+
     void setServerUrl(const QUrl& url)
         { setServerUrls(QUrlList() << url); }
 
@@ -89,10 +185,189 @@ public:
     bool sendMessage(const miMessage &msg);
     bool sendMessage(const miQMessage &qmsg, const ClientIds& to = ClientIds());
 
+    /*! Send a message from any thread. The message is queued without
+     *  locking and passed to sendMessage() in the thread owning this
+     *  CoClient; if it cannot be sent then, it is dropped.
+     */
+    void postMessage(const miQMessage &qmsg, const ClientIds& to = ClientIds());
+
+    //! Number of bytes queued for sending, but not yet written to the socket.
+    qint64 bytesPending() const;
+
+    /*! Set the send queue limits. sendQueueFull() is emitted when more
+     *  than high bytes are pending, sendQueueDrained() when the pending
+     *  size has dropped to low bytes or less again.
+     */
+    void setSendQueueWatermarks(qint64 high, qint64 low);
+
+    bool isSendQueueFull() const
+        { return mSendQueueFull; }
+
+    /*! Conflate outgoing messages with the given command: a new message
+     *  replaces a queued message that has not been written to the socket
+     *  yet if both have the same command, receivers and -- if commonField
+     *  is not empty -- the same value for this common field. If ttl is
+     *  positive, queued messages with this command are dropped when they
+     *  could not be written within ttl milliseconds.
+     */
+    void setSendConflation(const QString& command, const QString& commonField = QString(), int ttl = 0);
+    void removeSendConflation(const QString& command);
+
+    /*! Keep up to maxMessages messages with an estimated size of up to
+     *  maxBytes that are sent to the selected peers while not connected,
+     *  and send them after the next registration with a server. Conflation
+     *  is applied to the buffered messages; if the buffer is still full,
+     *  expired and then the oldest messages are dropped. Buffering is
+     *  disabled if maxMessages is 0.
+     */
+    void setOfflineBuffer(int maxMessages, qint64 maxBytes);
+
+    /*! If enabled, messages to all peers may be sent while
+     *  connecting, and they are written together with SETTYPE instead of
+     *  waiting for the registration reply from the server. Messages
+     *  buffered while not connected are also sent right after SETTYPE.
+     *  As peers are selected with SETPEERS after registration, this has
+     *  no effect while setSelectedPeerNames() restricts the peers.
+     *  Messages queued while connecting are dropped if the connection
+     *  attempt fails and offline buffering is disabled.
+     */
+    void setPipelinedHandshake(bool pipelined);
+
+    /*! Deliver only the newest of the received messages with the given
+     *  command that are available at the same time. Messages are
+     *  considered equivalent if they have the same sender, command and --
+     *  if commonField is not empty -- the same value for this common field.
+     */
+    void setLatestValueDelivery(const QString& command, const QString& commonField = QString());
+    void removeLatestValueDelivery(const QString& command);
+
+    //! Number of received messages dropped because of latest-value delivery.
+    quint64 countDroppedMessages() const
+        { return mDroppedMessages; }
+
+    /*! Limit the time spent reading and delivering messages in one event
+     *  loop iteration to at most maxMessages messages and maxMicroseconds
+     *  (0 for no limit). The remaining messages are handled in the next
+     *  iteration.
+     */
+    void setReadBudget(int maxMessages, int maxMicroseconds);
+
+    /*! If enabled, messages received in one event loop iteration are
+     *  delivered with a single receivedMessages() signal instead of
+     *  one receivedMessage() signal per message.
+     */
+    void setBatchedDelivery(bool batched)
+        { mBatchedDelivery = batched; }
+
+    /*! Send qmsg (e.g. settime) tagged with the wall-clock instant at
+     *  which receivers should apply it, in milliseconds since the epoch,
+     *  and the values of the steps expected next (e.g. the following
+     *  animation times) so receivers may prepare them.
+     */
+    bool sendScheduled(const miQMessage& qmsg, qint64 atMsecsSinceEpoch,
+            const QStringList& upcoming = QStringList(), const ClientIds& to = ClientIds());
+
+    /*! If enabled, received messages sent with sendScheduled() are
+     *  announced with prefetchHint() on arrival and delivered at their
+     *  instant instead of immediately. Otherwise they are delivered
+     *  immediately with the extra common fields.
+     */
+    void setScheduledDelivery(bool scheduled);
+
+    /*! Keep the last message with each of commands sent to all peers,
+     *  and send it to peers registering later, so that they know the
+     *  current state (e.g. settime, maparea) without asking.
+     */
+    void setRetainedCommands(const QStringList& commands);
+
+    /*! Deliver received messages with the given command to handler
+     *  instead of emitting receivedMessage() or receivedMessages().
+     *  Handlers for the same command are called in the order of
+     *  registration.
+     */
+    void registerHandler(const QString& command, const MessageHandler& handler);
+    void unregisterHandlers(const QString& command);
+
+    /*! Send request to client toId (or qmstrings::all) and call handler
+     *  with the reply, or after timeoutMs milliseconds without reply.
+     *
+     * The request is tagged with a qmstrings::request_id common field.
+     * Peers answering with sendReply() echo it, so any number of requests
+     * may be outstanding. Replies without request id are matched to the
+     * oldest outstanding request to the sender expecting replyCommand;
+     * unlike tagged replies, they are also delivered as usual.
+     *
+     * Returns the request id, or 0 if the request could not be sent.
+     */
+    quint32 request(const miQMessage& qmsg, int toId, const QString& replyCommand,
+            const ReplyHandler& handler, int timeoutMs = 5000);
+
+    //! Forget an outstanding request, its handler will not be called.
+    void cancelRequest(quint32 requestId);
+
+    //! Send reply to client toId, echoing the request id of request.
+    bool sendReply(const miQMessage& request, int toId, const miQMessage& reply);
+
+    /*! Cache replies to request() with command requestCommand, per peer and
+     *  request contents. Repeated requests are answered from the cache,
+     *  calling the handler before request() returns. Entries of a peer are
+     *  dropped when it sends a message with one of invalidatingCommands,
+     *  or after ttl milliseconds if ttl > 0.
+     */
+    void setResponseCaching(const QString& requestCommand,
+            const QStringList& invalidatingCommands, int ttl = 0);
+    void removeResponseCaching(const QString& requestCommand);
+    void clearResponseCache();
+
+    /*! Limit the number of received bytes buffered by the socket. When
+     *  the buffer is full, the socket stops reading and the sender sees
+     *  backpressure instead of this client's memory growing. A message
+     *  larger than the limit is still received. 0 for no limit.
+     */
+    void setReceiveBufferLimit(qint64 bytes);
+
+    /*! Grant the server credits for sending at most maxMessages messages
+     *  and maxBytes bytes (0 for no limit) to this client. Credits are
+     *  renewed when half of them have been consumed by reading. Requires
+     *  a server that understands SETCREDITS and ADDCREDITS; both limits
+     *  0 disables credits.
+     */
+    void setReceiveCredits(int maxMessages, qint64 maxBytes);
+
     void setSelectedPeerNames(const QStringList& names);
     const QStringList& getSelectedPeerNames()
         { return mSelectedPeerNames; }
 
+    /*! Receive only messages with one of the given commands from peers;
+     *  an empty list receives everything. The filter is sent to the
+     *  server with SETSUBSCRIPTIONS, and also applied when receiving in
+     *  case the server does not know this command. Reply commands for
+     *  request() must be included.
+     */
+    void subscribe(const QStringList& commands);
+    const QStringList& getSubscriptions() const
+        { return mSubscriptions; }
+
+    /*! Tell peers the region shown by this client, in degrees; with
+     *  lonMin > lonMax the region crosses the date line. Peers using
+     *  setSpatialFiltering() then send only rows inside this region.
+     */
+    void setViewport(double latMin, double latMax, double lonMin, double lonMax);
+    void clearViewport();
+
+    /*! Before sending messages with command to peers that have set a
+     *  viewport, drop data rows with a position in latColumn / lonColumn
+     *  outside the peer's viewport. Rows without valid position are kept.
+     *  A filtered message to all peers is sent to each of the connected
+     *  peers given to the server with the last SETPEERS separately.
+     *  The last message with command sent to all peers is kept; when a
+     *  peer changes or clears its viewport, it is sent to that peer
+     *  again with the rows for the new viewport.
+     */
+    void setSpatialFiltering(const QString& command, const QString& latColumn,
+            const QString& lonColumn);
+    void removeSpatialFiltering(const QString& command);
+
     ClientIds getClientIds() const;
     QString getClientType(int id) const;
     QString getClientName(int id) const;
@@ -104,9 +379,19 @@ public Q_SLOTS:
     void connectToServer();
     void disconnectFromServer();
 
+    /*! Write queued messages to the socket now instead of at the end of
+     *  the current event loop iteration. Useful for latency-critical messages.
+     */
+    void flush();
+
 Q_SIGNALS:
     void receivedMessage(int from, const miQMessage&);
     void receivedMessage(const miMessage&);
+    void receivedMessages(const CoClient::ReceivedMessages& messages);
+
+    //! A scheduled message arrived and will be delivered at atMsecsSinceEpoch.
+    void prefetchHint(int from, const miQMessage& qmsg, qint64 atMsecsSinceEpoch,
+            const QStringList& upcoming);
 
     void clientChange(int clientId, CoClient::ClientChange change);
 
@@ -118,14 +403,38 @@ Q_SIGNALS:
     void unableToConnect();
     void disconnected();
 
+    void sendQueueFull();
+    void sendQueueDrained();
+
+    //! A new round trip time was measured, see smoothedRtt().
+    void roundTripTime(int smoothedMs);
+
 private Q_SLOTS:
-    //! Read new incoming message.
-    void readNew();
+    void connectionReceived(const CoClient::ReceivedMessages& messages, qint64 bytes);
+
+    //! Deliver received messages.
+    void deliverIncoming();
 
     void connectionEstablished();
 
     void connectionClosed();
 
+    void connectionBytesWritten();
+    void flushScheduled();
+    void sendPosted();
+    void expireRequests();
+    void serverPathChanged();
+    void raceNext();
+    void racerConnected();
+    void racerFailed();
+    void sessionExpired();
+    void sendHeartbeat();
+    void connectStandby();
+    void standbyConnected();
+    void standbyClosed();
+    void standbyReceived(const CoClient::ReceivedMessages& messages, qint64 bytes);
+    void deliverScheduled();
+
     void tcpError(QAbstractSocket::SocketError e);
     void localError(QLocalSocket::LocalSocketError e);
     void connectServer();
@@ -135,28 +444,81 @@ private:
         QString type;
         QString name;
         bool connected;
-        Client(const QString& t, const QString& n)
-            : type(t), name(n), connected(false) { }
+        bool late; //!< registered after this client
+        Client(const QString& t, const QString& n, bool l)
+            : type(t), name(n), connected(false), late(l) { }
     };
 
     // map id -> Client(name, type, connected)
     typedef std::map<int, Client> clients_t;
 
+    // map id -> id, between server and application ids
+    typedef std::map<int, int> id_map_t;
+
+    // map origin -> id of the client sending with it
+    typedef std::map<QString, int> origin_clients_t;
+
+    struct ConflationRule {
+        QString commonField;
+        int ttl;
+        ConflationRule(const QString& f, int t)
+            : commonField(f), ttl(t) { }
+    };
+
+    // map command -> ConflationRule(commonField, ttl)
+    typedef std::map<QString, ConflationRule> conflation_t;
+
+    struct OutgoingMessage {
+        miQMessage qmsg;
+        ClientIds to;
+        QString key;    //!< empty if not conflated
+        qint64 expires; //!< mClock time, 0 for never
+        qint64 size;    //!< estimated
+        bool held;      //!< waiting for registration with the server
+    };
+
+    typedef std::list<OutgoingMessage> outgoing_t;
+
+    // map conflation key -> queued message
+    typedef std::map<QString, outgoing_t::iterator> outgoing_keys_t;
+
+    enum ConnectionState { UNCONNECTED, CONNECTING, CONNECTED, CLOSING };
+
 private:
     void initialize(const QString& clientType);
     void createSocket(const QUrl& serverUrl);
-    void createTcpSocket(const QUrl& serverUrl);
-    void createLocalSocket(const QUrl& serverUrl);
+    CoConnection* newConnection();
+    void connectConnectionSignals(CoConnection* connection);
+    void startConnecting(CoConnection* connection, const QUrl& serverUrl);
+    void startSession();
+    void startRace();
+    void stopRace();
     void destroySocket();
+    bool isCurrentConnection();
+    void sendReadLimits();
     void tryToStartOrConnectNext();
     bool tryToStartCoServer();
+    void waitForServer(const QUrl& serverUrl);
+    bool isWaitingForServer() const;
+    void stopWaitingForServer();
     void tryReconnectAfterTimeout();
+    int reconnectDelay();
     void tryConnectNextServer();
     bool isLocalServer(const QUrl& url);
     void rewindServerList();
 
     void sendClientType();
     void sendMessageToServer(const miQMessage& qmsg);
+    void enqueueMessage(const miQMessage& qmsg, const ClientIds& to, bool front = false);
+    void eraseOutgoing(outgoing_t::iterator it);
+    void writeOutgoing(bool all);
+    void keepOfflineMessages();
+    void limitOfflineMessages();
+    void releaseHeldMessages();
+    bool isPipelining() const;
+    void scheduleFlush();
+    void checkSendQueueFull();
+    void checkSendQueueDrained();
 
     bool messageFromServer(const miQMessage& qmsg);
     void handleRegisteredClient(const miQMessage& qmsg);
@@ -165,14 +527,59 @@ private:
     void handleRemoveClient(const miQMessage& qmsg);
     void handleRenameClient(const miQMessage& qmsg);
 
+    void scheduleDeliver();
+    void dropSuperseded(ReceivedMessages& incoming);
+    bool dispatchToHandlers(int fromId, const miQMessage& qmsg);
+    bool dispatchReply(int fromId, const miQMessage& qmsg);
+    void scheduleRequestTimer();
+    void failRequests(int toId = qmstrings::all);
+    bool scheduleDelivery(const ReceivedMessage& rm);
+    void scheduleDeliveryTimer();
+    //! Drop cached replies of fromId invalidated by command, or all if command is empty.
+    void invalidateResponses(int fromId, const QString& command);
+    void sendCredits(bool initial);
+    bool creditsMessage(bool initial, int& consumedMessages, qint64& consumedBytes,
+            miQMessage& credits) const;
     void emitMessage(int fromId, const miQMessage& qmsg);
 
     void sendSetPeers();
+    void placeServerUrls();
+    void connectionLost();
+    bool sendStamped(const miQMessage& qmsg, const ClientIds& to);
+    miQMessage clientTypeMessage() const;
+    bool isDuplicate(const miQMessage& qmsg);
+    void scheduleStandby(int delayMs);
+    void closeStandby();
+    bool promoteStandby();
+    void matchStandbyPeers(id_map_t& standbyToLocal) const;
+    void trackStandbyRegistry(const miQMessage& qmsg);
+    void sendToStandby(const miQMessage& qmsg);
+    void sendStandbySetPeers();
+    void sendStandbyCredits(bool initial);
+    void sendStandbySubscriptions();
+    int localId(int id);
+    int serverId(int id) const;
+    ClientIds serverIds(const ClientIds& ids) const;
+    void forgetPeer(int id);
+    void forgetClients();
+    void handlePong(const miQMessage& qmsg);
+    void sendRetained(int toId);
+    void sendViewport(const ClientIds& to);
+    bool handleViewport(int fromId, const miQMessage& qmsg);
+    bool sendSpatiallyFiltered(const miQMessage& qmsg, const ClientIds& to);
+    void sendSubscriptions();
+    miQMessage subscriptionsMessage() const;
+    bool isSubscribed(const QString& command) const;
 
 private:
-    QTcpSocket *tcpSocket;
-    QLocalSocket *localSocket;
-    std::unique_ptr<miMessageIO> io;
+    CoConnection* mConnection;
+    ConnectionState mConnectionState;
+    bool mUseIoThread;
+    QThread* mIoThread;
+
+    class PostedQueue;
+    std::unique_ptr<PostedQueue> mPosted;
+    std::atomic<bool> mPostedScheduled;
 
     int mId;
     QString clientType;
@@ -180,15 +587,188 @@ private:
     QString name;
 
     QStringList mSelectedPeerNames;
+    ClientIds mPeerIds; //!< as sent with the last SETPEERS
+    QStringList mSubscriptions;
+
+    QStringList mRetainedCommands;
+    // map command -> last message sent to all peers
+    typedef std::map<QString, miQMessage> retained_t;
+    retained_t mRetained;
+
+    struct Viewport {
+        double latMin, latMax, lonMin, lonMax;
+        Viewport()
+            : latMin(0), latMax(0), lonMin(0), lonMax(0) { }
+        Viewport(double la0, double la1, double lo0, double lo1)
+            : latMin(la0), latMax(la1), lonMin(lo0), lonMax(lo1) { }
+        bool operator==(const Viewport& o) const
+            { return latMin == o.latMin && latMax == o.latMax && lonMin == o.lonMin && lonMax == o.lonMax; }
+    };
+
+    bool mHasViewport;
+    Viewport mViewport;
+
+    // map peer id -> viewport
+    typedef std::map<int, Viewport> viewports_t;
+    viewports_t mPeerViewports;
+
+    // map command -> (lat column, lon column)
+    typedef std::map<QString, std::pair<QString, QString> > spatial_filters_t;
+    spatial_filters_t mSpatialFilters;
+    retained_t mFilteredLast; //!< last filtered message to all peers, per command
 
     clients_t clients;
 
     QString serverCommand;
     QUrlList serverUrls;
+    QUrlList mConfiguredUrls; //!< as passed to setServerUrls
+    bool mHashedPlacement;
     int serverIndex;
     int serverStarting;
 
     bool mAttemptToStartServer;
+
+    int mReconnectFirstMs;
+    int mReconnectInitialMs;
+    int mReconnectMaxMs;
+    double mReconnectFactor;
+    double mReconnectJitter;
+    int mReconnectAttempts; //!< since the last successful connection
+    QTimer* mReconnectTimer;
+
+    int mRaceStaggerMs;
+    bool mRaceFailed; //!< all servers failed in the last race
+    QList<int> mRaceOrder; //!< server indices not tried yet
+    // map connection attempt -> server index
+    typedef std::map<CoConnection*, int> racers_t;
+    racers_t mRacers;
+    QTimer* mRaceTimer;
+
+    int mSessionGraceMs;
+    QString mSessionToken; //!< empty if there is no session to resume
+    int mSessionId;
+    QTimer* mSessionTimer;
+
+    int mHeartbeatMisses; //!< intervals without answer before failover
+    int mHeartbeatOutstanding; //!< intervals without data from the server
+    quint32 mHeartbeatSeq;
+    std::map<quint32, qint64> mPingsSent; //!< seq -> mClock time
+    int mSmoothedRtt8; //!< 8 times the smoothed round trip time, -1 if unknown
+    QTimer* mHeartbeatTimer;
+
+    bool mHotStandby;
+    CoConnection* mStandby;
+    int mStandbyIndex; //!< index in serverUrls
+    int mStandbyId; //!< this client's id at the standby server, -1 until registered
+    QString mStandbySessionToken;
+    clients_t mStandbyClients; //!< by ids at the standby server
+    origin_clients_t mStandbyOrigins; //!< ids at the standby server
+    ReceivedMessages mStandbyIncoming; //!< copies from the standby, sender ids mapped, not delivered yet
+    int mStandbyConsumedMessages;
+    qint64 mStandbyConsumedBytes;
+    QTimer* mStandbyTimer;
+    QString mOrigin; //!< identifies messages sent by this client through several servers
+    quint32 mOriginSeq;
+    std::unique_ptr<coclient::DuplicateFilter> mDuplicates;
+    origin_clients_t mOriginClients; //!< ids as known by the application
+
+    // after switching to the standby, peers keep the ids the application knows
+    id_map_t mLocalIds; //!< server id -> application id
+    id_map_t mServerIds; //!< application id -> server id
+
+    std::unique_ptr<QLockFile> mServerStartLock; //!< held while starting a server
+    QFileSystemWatcher* mServerWatcher;
+    QString mServerPath; //!< local socket path of the server being started
+    qint64 mServerWaitDeadline; //!< mClock time, 0 if not waiting for a server
+
+    qint64 mSendQueueHigh;
+    qint64 mSendQueueLow;
+    bool mSendQueueFull;
+    bool mFlushScheduled;
+
+    conflation_t mSendConflation;
+    outgoing_t mOutgoing;
+    outgoing_keys_t mOutgoingKeys;
+    qint64 mOutgoingBytes;
+    int mOfflineMaxMessages;
+    qint64 mOfflineMaxBytes;
+    bool mPipelinedHandshake;
+    QElapsedTimer mClock;
+
+    conflation_t mLatestValueDelivery;
+    quint64 mDroppedMessages;
+
+    int mReadBudgetMessages;
+    int mReadBudgetMicroseconds;
+    bool mBatchedDelivery;
+    bool mDelivering;
+    bool mDeliverScheduled;
+    ReceivedMessages mIncoming; //!< read, but not delivered yet
+
+    struct Handler {
+        QString command; //!< to be safe against hash collisions
+        MessageHandler handler;
+        Handler(const QString& c, const MessageHandler& h)
+            : command(c), handler(h) { }
+    };
+    typedef std::vector<Handler> handler_list_t;
+
+    // map command id -> handlers
+    typedef std::unordered_map<qmstrings::command_id, handler_list_t> handlers_t;
+    handlers_t mHandlers;
+
+    struct PendingRequest {
+        quint32 id;
+        int to;
+        QString replyCommand;
+        ReplyHandler handler;
+        qint64 deadline; //!< mClock time
+        QString requestCommand;
+        QString cacheKey; //!< empty if not cached
+        PendingRequest(quint32 i, int t, const QString& rc, const ReplyHandler& h, qint64 d)
+            : id(i), to(t), replyCommand(rc), handler(h), deadline(d) { }
+    };
+
+    // in the order sent
+    typedef std::list<PendingRequest> requests_t;
+    requests_t mRequests;
+    quint32 mNextRequestId;
+    QTimer* mRequestTimer;
+
+    bool mScheduledDelivery;
+    // map epoch ms -> message, multimap keeps arrival order for equal times
+    typedef std::multimap<qint64, ReceivedMessage> scheduled_t;
+    scheduled_t mScheduled;
+    QTimer* mScheduleTimer;
+
+    struct CachingRule {
+        QStringList invalidatingCommands;
+        int ttl;
+        CachingRule(const QStringList& ic, int t)
+            : invalidatingCommands(ic), ttl(t) { }
+    };
+
+    // map request command -> caching rule
+    typedef std::map<QString, CachingRule> caching_rules_t;
+    caching_rules_t mCachingRules;
+
+    struct CachedResponse {
+        QString requestCommand;
+        int peer; //!< receiver of the request
+        int from;
+        miQMessage reply;
+        qint64 expires; //!< mClock time, 0 for never
+    };
+
+    // map request key -> cached reply
+    typedef std::map<QString, CachedResponse> response_cache_t;
+    response_cache_t mResponseCache;
+
+    qint64 mReadBufferLimit;
+    int mCreditMessages;
+    qint64 mCreditBytes;
+    int mConsumedMessages;
+    qint64 mConsumedBytes;
 };
 
 #endif // METLIBS_COSERVER_COCLIENT
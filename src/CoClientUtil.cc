@@ -0,0 +1,150 @@
+/**
+ * coserver client file
+ *
+ * Copyright (C) 2026 met.no
+ *
+ * Contact information:
+ * Norwegian Meteorological Institute
+ * Box 43 Blindern
+ * 0313 OSLO
+ * NORWAY
+ * email: diana@met.no
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "CoClientUtil.h"
+#include "QLetterCommands.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace coclient {
+
+const double RowGrid::CELL_DEGREES = 1.0;
+
+RowGrid::RowGrid(const miQMessage& qmsg, int latColumn, int lonColumn)
+{
+    mEntries.reserve(qmsg.countDataRows());
+    for (int r = 0; r < qmsg.countDataRows(); ++r) {
+        const QStringList& values = qmsg.getDataValues(r);
+        bool latOk = false, lonOk = false;
+        Entry e;
+        if (latColumn < values.size() && lonColumn < values.size()) {
+            e.lat = values.at(latColumn).toDouble(&latOk);
+            e.lon = values.at(lonColumn).toDouble(&lonOk);
+        }
+        if (!latOk || !lonOk) {
+            mUnplaced.push_back(r);
+            continue;
+        }
+        e.latCell = cell(e.lat);
+        e.lonCell = cell(e.lon);
+        e.row = r;
+        mEntries.push_back(e);
+    }
+    std::sort(mEntries.begin(), mEntries.end());
+}
+
+std::vector<int> RowGrid::select(double latMin, double latMax, double lonMin, double lonMax) const
+{
+    std::vector<int> rows(mUnplaced);
+    if (lonMin <= lonMax) {
+        selectRange(rows, latMin, latMax, lonMin, lonMax);
+    } else {
+        // crossing the date line
+        selectRange(rows, latMin, latMax, lonMin, 180);
+        selectRange(rows, latMin, latMax, -180, lonMax);
+    }
+    std::sort(rows.begin(), rows.end());
+    return rows;
+}
+
+void RowGrid::selectRange(std::vector<int>& rows, double latMin, double latMax,
+        double lonMin, double lonMax) const
+{
+    const int lonCellMax = cell(lonMax);
+    for (int latCell = cell(latMin); latCell <= cell(latMax); ++latCell) {
+        Entry first;
+        first.latCell = latCell;
+        first.lonCell = cell(lonMin);
+        std::vector<Entry>::const_iterator it = std::lower_bound(mEntries.begin(), mEntries.end(), first);
+        for (; it != mEntries.end() && it->latCell == latCell && it->lonCell <= lonCellMax; ++it) {
+            if (it->lat >= latMin && it->lat <= latMax && it->lon >= lonMin && it->lon <= lonMax)
+                rows.push_back(it->row);
+        }
+    }
+}
+
+bool DuplicateFilter::isDuplicate(const QString& origin, quint32 seq)
+{
+    std::set<quint32>& seen = mSeen[origin];
+    if (seen.size() >= mKept && seq < *seen.begin())
+        return true; // too old to tell, assume it is a duplicate
+    if (!seen.insert(seq).second)
+        return true;
+    if (seen.size() > mKept)
+        seen.erase(seen.begin());
+    return false;
+}
+
+double backoffDelay(int attempt, int firstMs, int initialMs, int maxMs, double factor)
+{
+    if (attempt <= 0)
+        return firstMs;
+    return std::min(initialMs * std::pow(factor, attempt - 1), double(maxMs));
+}
+
+int jitteredDelay(double delayMs, double jitter, double fraction)
+{
+    return int(delayMs * (1 - jitter * fraction));
+}
+
+quint32 ringHash(const QString& key)
+{
+    // FNV-1a, then the murmur3 finalizer to spread similar keys over the ring
+    quint32 h = qmstrings::command_hash(key.toUtf8().constData());
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+QList<QUrl> ringOrder(const QList<QUrl>& urls, const QString& key, int replicas)
+{
+    std::map<quint32, int> ring;
+    for (int i = 0; i < urls.size(); ++i) {
+        const QString u = urls.at(i).toString(QUrl::RemovePassword);
+        for (int r = 0; r < replicas; ++r)
+            ring.insert(std::make_pair(ringHash(u + '#' + QString::number(r)), i));
+    }
+
+    QList<QUrl> ordered;
+    std::vector<bool> used(urls.size(), false);
+    std::map<quint32, int>::const_iterator it = ring.lower_bound(ringHash(key));
+    for (size_t n = 0; n < ring.size() && ordered.size() < urls.size(); ++n, ++it) {
+        if (it == ring.end())
+            it = ring.begin();
+        if (!used[it->second]) {
+            used[it->second] = true;
+            ordered << urls.at(it->second);
+        }
+    }
+    return ordered;
+}
+
+} // namespace coclient
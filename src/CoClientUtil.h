@@ -0,0 +1,126 @@
+// -*- c++ -*-
+/**
+ * coserver client file
+ *
+ * Copyright (C) 2026 met.no
+ *
+ * Contact information:
+ * Norwegian Meteorological Institute
+ * Box 43 Blindern
+ * 0313 OSLO
+ * NORWAY
+ * email: diana@met.no
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METLIBS_COSERVER_COCLIENTUTIL_H
+#define METLIBS_COSERVER_COCLIENTUTIL_H 1
+
+#include "miMessage.h"
+
+#include <QtCore/QList>
+#include <QtCore/QUrl>
+
+#include <cmath>
+#include <map>
+#include <set>
+#include <vector>
+
+//! Internal helpers of CoClient, kept apart so that they can be tested.
+namespace coclient {
+
+/*! Data rows of a message sorted into a grid by position, for selecting
+ *  the rows inside a bounding box without looking at all rows.
+ */
+class RowGrid {
+public:
+    RowGrid(const miQMessage& qmsg, int latColumn, int lonColumn);
+
+    //! rows inside the box and rows without valid position, in message order
+    std::vector<int> select(double latMin, double latMax, double lonMin, double lonMax) const;
+
+private:
+    struct Entry {
+        int latCell, lonCell;
+        double lat, lon;
+        int row;
+        Entry()
+            : latCell(0), lonCell(0), lat(0), lon(0), row(-1) { }
+        bool operator<(const Entry& o) const
+            { return latCell < o.latCell || (latCell == o.latCell && lonCell < o.lonCell); }
+    };
+
+    static int cell(double degrees)
+        { return int(std::floor(degrees / CELL_DEGREES)); }
+
+    void selectRange(std::vector<int>& rows, double latMin, double latMax,
+            double lonMin, double lonMax) const;
+
+private:
+    static const double CELL_DEGREES;
+    std::vector<Entry> mEntries; //!< sorted by cell
+    std::vector<int> mUnplaced;
+};
+
+/*! Sequence numbers recently received from each origin, for dropping
+ *  copies of a message that arrive through several servers.
+ */
+class DuplicateFilter {
+public:
+    //! keep up to kept sequence numbers per origin
+    explicit DuplicateFilter(size_t kept)
+        : mKept(kept) { }
+
+    //! Record seq from origin; true if it was seen before or is too old to tell.
+    bool isDuplicate(const QString& origin, quint32 seq);
+
+    //! Drop what is known about origin, e.g. when its client has left.
+    void forget(const QString& origin)
+        { mSeen.erase(origin); }
+
+    void clear()
+        { mSeen.clear(); }
+
+    size_t countOrigins() const
+        { return mSeen.size(); }
+
+private:
+    size_t mKept;
+    // map origin -> recently received sequence numbers
+    typedef std::map<QString, std::set<quint32> > seen_t;
+    seen_t mSeen;
+};
+
+/*! Wait in ms before reconnect attempt number attempt, counting from 0:
+ *  firstMs for the first, then initialMs multiplied by factor for each
+ *  further attempt, up to maxMs.
+ */
+double backoffDelay(int attempt, int firstMs, int initialMs, int maxMs, double factor);
+
+//! delayMs shortened by jitter (0..1) times fraction (0..1).
+int jitteredDelay(double delayMs, double jitter, double fraction);
+
+//! FNV-1a with the murmur3 finalizer, to spread similar keys over a hash ring
+quint32 ringHash(const QString& key);
+
+/*! urls in the order met on a consistent hash ring, starting at key;
+ *  each url is placed on the ring replicas times.
+ */
+QList<QUrl> ringOrder(const QList<QUrl>& urls, const QString& key, int replicas);
+
+} // namespace coclient
+
+#endif // METLIBS_COSERVER_COCLIENTUTIL_H
@@ -0,0 +1,228 @@
+/**
+ * coserver client file
+ *
+ * Copyright (C) 2026 met.no
+ *
+ * Contact information:
+ * Norwegian Meteorological Institute
+ * Box 43 Blindern
+ * 0313 OSLO
+ * NORWAY
+ * email: diana@met.no
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "CoConnection.h"
+
+#include "miMessageIO.h"
+
+#include <QtCore/QTimer>
+
+#include <algorithm>
+
+#define MILOGGER_CATEGORY "coserver.CoConnection"
+#include <qUtilities/miLoggingQt.h>
+
+CoConnection::CoConnection(QObject* parent)
+    : QObject(parent)
+    , mTcpSocket(0)
+    , mLocalSocket(0)
+    , mMaxPending(0)
+    , mPending(0)
+    , mReadBufferLimit(0)
+    , mReadMoreScheduled(false)
+    , mInTransit(0)
+    , mUnsent(0)
+{
+}
+
+CoConnection::~CoConnection()
+{
+    METLIBS_LOG_SCOPE();
+}
+
+void CoConnection::connectToHost(const QString& host, quint16 port)
+{
+    METLIBS_LOG_SCOPE();
+    mTcpSocket = new QTcpSocket(this);
+    connect(mTcpSocket, SIGNAL(error(QAbstractSocket::SocketError)),
+            SIGNAL(tcpError(QAbstractSocket::SocketError)));
+    connectSocketSignals(mTcpSocket);
+
+    METLIBS_LOG_INFO("connecting to host '" << host << "' port " << port);
+    mTcpSocket->connectToHost(host, port);
+}
+
+void CoConnection::connectToServer(const QString& path)
+{
+    METLIBS_LOG_SCOPE();
+    mLocalSocket = new QLocalSocket(this);
+    connect(mLocalSocket, SIGNAL(error(QLocalSocket::LocalSocketError)),
+            SIGNAL(localError(QLocalSocket::LocalSocketError)));
+    connectSocketSignals(mLocalSocket);
+
+    METLIBS_LOG_INFO("connecting to server '" << path << "'");
+    mLocalSocket->connectToServer(path);
+}
+
+void CoConnection::connectSocketSignals(QIODevice* device)
+{
+    connect(device, SIGNAL(connected()),
+            SLOT(socketConnected()));
+    connect(device, SIGNAL(disconnected()),
+            SIGNAL(disconnected()));
+    connect(device, SIGNAL(readyRead()),
+            SLOT(readMore()));
+    connect(device, SIGNAL(bytesWritten(qint64)),
+            SLOT(socketBytesWritten()));
+}
+
+QIODevice* CoConnection::socketDevice() const
+{
+    if (mTcpSocket)
+        return mTcpSocket;
+    else if (mLocalSocket)
+        return mLocalSocket;
+    else
+        return 0;
+}
+
+void CoConnection::socketConnected()
+{
+    METLIBS_LOG_SCOPE();
+    QIODevice* device = socketDevice();
+    if (!device)
+        return;
+
+    mIO.reset(new miMessageIO(device, false));
+    mIO->setBufferWrites(true);
+    if (mTcpSocket)
+        mTcpSocket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    setSocketReadBufferSize(mReadBufferLimit);
+    mPending = 0;
+
+    Q_EMIT connected();
+}
+
+void CoConnection::close()
+{
+    METLIBS_LOG_SCOPE();
+    // the socket writes pending data before disconnecting
+    if (mTcpSocket)
+        mTcpSocket->disconnectFromHost();
+    else if (mLocalSocket)
+        mLocalSocket->disconnectFromServer();
+}
+
+void CoConnection::send(const CoConnection::Messages& messages, qint64 estimatedBytes)
+{
+    METLIBS_LOG_SCOPE(LOGVAL(messages.size()));
+    mInTransit -= estimatedBytes;
+    if (!mIO) {
+        METLIBS_LOG_WARN("not connected, dropping " << messages.size() << " messages");
+        return;
+    }
+
+    // all messages are written to the socket as one block
+    for (Messages::const_iterator it = messages.begin(); it != messages.end(); ++it)
+        mIO->write(-1 /*ignored*/, it->to, it->qmsg);
+    mIO->flush();
+    if (mTcpSocket)
+        mTcpSocket->flush();
+    else if (mLocalSocket)
+        mLocalSocket->flush();
+    updateUnsent();
+}
+
+void CoConnection::updateUnsent()
+{
+    if (mIO)
+        mUnsent = mIO->bytesBuffered() + socketDevice()->bytesToWrite();
+    else
+        mUnsent = 0;
+}
+
+void CoConnection::socketBytesWritten()
+{
+    updateUnsent();
+    Q_EMIT bytesWritten();
+}
+
+void CoConnection::setReadLimits(int maxPending, qint64 readBufferLimit)
+{
+    mMaxPending = std::max(maxPending, 0);
+    mReadBufferLimit = std::max(readBufferLimit, qint64(0));
+    setSocketReadBufferSize(mReadBufferLimit);
+    adjustReadBuffer();
+    // the limits might have been raised
+    scheduleReadMore();
+}
+
+void CoConnection::consumed(int messages)
+{
+    mPending = std::max(mPending - messages, 0);
+    if (mIO && socketDevice()->bytesAvailable() > 0)
+        scheduleReadMore();
+}
+
+void CoConnection::scheduleReadMore()
+{
+    if (!mReadMoreScheduled) {
+        mReadMoreScheduled = true;
+        QTimer::singleShot(0, this, SLOT(readMore()));
+    }
+}
+
+void CoConnection::readMore()
+{
+    METLIBS_LOG_SCOPE();
+    mReadMoreScheduled = false;
+    if (!mIO)
+        return;
+
+    CoClient::ReceivedMessages messages;
+    const quint64 bytesReadBefore = mIO->bytesRead();
+    while (mMaxPending <= 0 || mPending < mMaxPending) {
+        int from;
+        ClientIds to;
+        miQMessage qmsg;
+        if (!mIO->read(from, to, qmsg))
+            break;
+        messages << CoClient::ReceivedMessage(from, qmsg);
+        mPending += 1;
+    }
+    adjustReadBuffer();
+
+    if (!messages.isEmpty())
+        Q_EMIT received(messages, mIO->bytesRead() - bytesReadBefore);
+}
+
+void CoConnection::setSocketReadBufferSize(qint64 size)
+{
+    if (mTcpSocket)
+        mTcpSocket->setReadBufferSize(size);
+    else if (mLocalSocket)
+        mLocalSocket->setReadBufferSize(size);
+}
+
+void CoConnection::adjustReadBuffer()
+{
+    if (mReadBufferLimit <= 0 || !mIO)
+        return;
+    // the socket must be able to buffer a complete message, otherwise
+    // reading would stall forever
+    setSocketReadBufferSize(std::max(mReadBufferLimit, qint64(mIO->pendingReadSize())));
+}
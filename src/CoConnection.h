@@ -0,0 +1,132 @@
+// -*- c++ -*-
+/**
+ * coserver client file
+ *
+ * Copyright (C) 2026 met.no
+ *
+ * Contact information:
+ * Norwegian Meteorological Institute
+ * Box 43 Blindern
+ * 0313 OSLO
+ * NORWAY
+ * email: diana@met.no
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METLIBS_COSERVER_COCONNECTION_H
+#define METLIBS_COSERVER_COCONNECTION_H 1
+
+#include "CoClient.h"
+
+#include <atomic>
+#include <memory>
+
+class miMessageIO;
+
+/*! Socket, message framing and encoding / decoding for one connection
+ *  of CoClient to a server.
+ *
+ * The object may be moved to another thread; then all slots must be
+ * invoked with queued connections and only bytesUnsent() may be called
+ * directly from other threads.
+ */
+class CoConnection : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Message {
+        ClientIds to;
+        miQMessage qmsg;
+        Message() { }
+        Message(const ClientIds& t, const miQMessage& q)
+            : to(t), qmsg(q) { }
+    };
+
+    typedef QVector<Message> Messages;
+
+public:
+    CoConnection(QObject* parent = 0);
+    ~CoConnection();
+
+    //! Bytes passed to send() but not yet written to the socket; thread-safe.
+    qint64 bytesUnsent() const
+        { return mInTransit.load() + mUnsent.load(); }
+
+    //! Account for messages that will be passed to send() soon; thread-safe.
+    void addInTransit(qint64 estimatedBytes)
+        { mInTransit += estimatedBytes; }
+
+public Q_SLOTS:
+    void connectToHost(const QString& host, quint16 port);
+    void connectToServer(const QString& path);
+
+    //! Disconnect after writing pending data.
+    void close();
+
+    /*! Encode and write messages. estimatedBytes must be the amount
+     *  passed to addInTransit() before.
+     */
+    void send(const CoConnection::Messages& messages, qint64 estimatedBytes);
+
+    /*! Stop decoding when maxPending messages have been emitted with
+     *  received() but not yet acknowledged with consumed(), and limit the
+     *  socket read buffer to readBufferLimit bytes. 0 means no limit.
+     */
+    void setReadLimits(int maxPending, qint64 readBufferLimit);
+
+    //! Acknowledge that messages emitted with received() have been handled.
+    void consumed(int messages);
+
+Q_SIGNALS:
+    void connected();
+    void disconnected();
+    void tcpError(QAbstractSocket::SocketError e);
+    void localError(QLocalSocket::LocalSocketError e);
+
+    //! Decoded messages, and the number of bytes they occupied on the wire.
+    void received(const CoClient::ReceivedMessages& messages, qint64 bytes);
+
+    void bytesWritten();
+
+private Q_SLOTS:
+    void socketConnected();
+    void socketBytesWritten();
+    void readMore();
+
+private:
+    void connectSocketSignals(QIODevice* device);
+    QIODevice* socketDevice() const;
+    void setSocketReadBufferSize(qint64 size);
+    void adjustReadBuffer();
+    void scheduleReadMore();
+    void updateUnsent();
+
+private:
+    QTcpSocket* mTcpSocket;
+    QLocalSocket* mLocalSocket;
+    std::unique_ptr<miMessageIO> mIO;
+
+    int mMaxPending;
+    int mPending;
+    qint64 mReadBufferLimit;
+    bool mReadMoreScheduled;
+
+    std::atomic<qint64> mInTransit;
+    std::atomic<qint64> mUnsent;
+};
+
+#endif // METLIBS_COSERVER_COCONNECTION_H
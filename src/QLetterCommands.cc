@@ -1,6 +1,8 @@
 
 #include "QLetterCommands.h"
 
+#include <QString>
+
 namespace qmstrings{
 extern const char vprof[]               = "vprof";
 extern const char vcross[]              = "vcross";
@@ -57,8 +59,34 @@ extern const char getmaparea[]          = "getmaparea";
 extern const char maparea[]             = "maparea";
 extern const char directory_changed[]   = "directory_changed";
 extern const char file_changed[]        = "file_changed";
+extern const char viewport[]            = "viewport";
+
+extern const char request_id[]          = "request_id";
+extern const char origin[]              = "origin";
+extern const char origin_seq[]          = "origin_seq";
+extern const char scheduled_at[]        = "scheduled_at";
+extern const char upcoming[]            = "upcoming";
+extern const char ping[]                = "PING";
+extern const char pong[]                = "PONG";
+extern const char seq[]                 = "seq";
+extern const char session[]             = "session";
+extern const char resumed[]             = "resumed";
+extern const char resume_session[]      = "resume_session";
+extern const char resume_id[]           = "resume_id";
 
 extern const int default_id = -1000;
 extern const int all = -1;
 extern const int port = 19444;
+
+command_id command_hash(const QString& command)
+{
+  command_id h = 2166136261u;
+  for (int i=0; i<command.size(); ++i) {
+    const ushort u = command.at(i).unicode();
+    if (u >= 0x80)
+      return command_hash(command.toUtf8().constData());
+    h = (h ^ u) * 16777619u;
+  }
+  return h;
+}
 };
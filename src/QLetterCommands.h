@@ -29,6 +29,8 @@
 #ifndef _QLetterCommands_h
 #define _QLetterCommands_h
 
+class QString;
+
 namespace qmstrings{
 extern const char vprof[];
 extern const char vcross[];
@@ -85,9 +87,107 @@ extern const char getmaparea[];
 extern const char maparea[];
 extern const char directory_changed[];
 extern const char file_changed[];
+extern const char viewport[];
+
+//! common field tagging requests sent with CoClient::request()
+extern const char request_id[];
+
+//! common fields identifying messages sent through several servers
+extern const char origin[];
+extern const char origin_seq[];
+
+//! common fields of messages sent with CoClient::sendScheduled()
+extern const char scheduled_at[];
+extern const char upcoming[];
+
+//! heartbeat commands exchanged with the server, and their common field
+extern const char ping[];
+extern const char pong[];
+extern const char seq[];
+
+//! common fields for resuming a server session after a short disconnect
+extern const char session[];
+extern const char resumed[];
+extern const char resume_session[];
+extern const char resume_id[];
 
 extern const int default_id;
 extern const int all;
 extern const int port;
+
+typedef unsigned int command_id;
+
+//! FNV-1a hash of a command name, may be evaluated at compile time
+constexpr command_id command_hash(const char* command, command_id h = 2166136261u)
+{
+  return *command
+      ? command_hash(command + 1, (h ^ static_cast<unsigned char>(*command)) * 16777619u)
+      : h;
+}
+
+//! same value as command_hash(command.toUtf8().constData())
+command_id command_hash(const QString& command);
+
+//! interned ids of the commands above, for switch statements and hash lookups
+namespace ids {
+constexpr command_id vprof                 = command_hash("vprof");
+constexpr command_id vcross                = command_hash("vcross");
+constexpr command_id addimage              = command_hash("addimage");
+constexpr command_id positions             = command_hash("positions");
+constexpr command_id showpositions         = command_hash("showpositions");
+constexpr command_id hidepositions         = command_hash("hidepositions");
+constexpr command_id changeimage           = command_hash("changeimage");
+constexpr command_id showpositionname      = command_hash("showpositionname");
+constexpr command_id showpositiontext      = command_hash("showpositiontext");
+constexpr command_id enableposclick        = command_hash("enableposclick");
+constexpr command_id enableposmove         = command_hash("enableposmove");
+constexpr command_id showtext              = command_hash("showtext");
+constexpr command_id enableshowtext        = command_hash("enableshowtext");
+constexpr command_id textrequest           = command_hash("textrequest");
+constexpr command_id selectposition        = command_hash("selectposition");
+constexpr command_id settime               = command_hash("settime");
+constexpr command_id remove                = command_hash("remove");
+constexpr command_id removeclient          = command_hash("removeclient");
+constexpr command_id renameclient          = command_hash("renameclient");
+constexpr command_id registeredclient      = command_hash("registeredclient");
+constexpr command_id unregisteredclient    = command_hash("unregisteredclient");
+constexpr command_id newclient             = command_hash("newclient");
+constexpr command_id allclients            = command_hash("allclients");
+constexpr command_id timechanged           = command_hash("timechanged");
+constexpr command_id init_HQC_params       = command_hash("init_HQC_params");
+constexpr command_id update_HQC_params     = command_hash("update_HQC_params");
+constexpr command_id select_HQC_param      = command_hash("select_HQC_param");
+constexpr command_id apply_quickmenu       = command_hash("apply_quickmenu");
+constexpr command_id station               = command_hash("station");
+constexpr command_id changeimageandtext    = command_hash("change_image_and_text");
+constexpr command_id changeimageandimage   = command_hash("change_image_and_image");
+constexpr command_id seteditpositions      = command_hash("seteditpositions");
+constexpr command_id editposition          = command_hash("editposition");
+constexpr command_id copyvalue             = command_hash("copyvalue");
+constexpr command_id areas                 = command_hash("areas");
+constexpr command_id selectarea            = command_hash("selectarea");
+constexpr command_id areacommand           = command_hash("areacommand");
+constexpr command_id showarea              = command_hash("showarea");
+constexpr command_id changearea            = command_hash("changearea");
+constexpr command_id deletearea            = command_hash("deletearea");
+constexpr command_id annotation            = command_hash("annotation");
+constexpr command_id changetype            = command_hash("changetype");
+constexpr command_id autoredraw            = command_hash("autoredraw");
+constexpr command_id redraw                = command_hash("redraw");
+constexpr command_id sendkey               = command_hash("sendkey");
+constexpr command_id editmode              = command_hash("editmode");
+constexpr command_id printclicked          = command_hash("printclicked");
+constexpr command_id getcurrentplotcommand = command_hash("getcurrentplotcommand");
+constexpr command_id currentplotcommand    = command_hash("currentplotcommand");
+constexpr command_id getproj4maparea       = command_hash("getproj4maparea");
+constexpr command_id proj4maparea          = command_hash("proj4maparea");
+constexpr command_id getmaparea            = command_hash("getmaparea");
+constexpr command_id maparea               = command_hash("maparea");
+constexpr command_id directory_changed     = command_hash("directory_changed");
+constexpr command_id file_changed          = command_hash("file_changed");
+constexpr command_id viewport              = command_hash("viewport");
+constexpr command_id ping                  = command_hash("PING");
+constexpr command_id pong                  = command_hash("PONG");
+} // namespace ids
 }
 #endif
@@ -1,9 +1,9 @@
 #ifndef METLIBS_COSERVER_VERSION_H
 #define METLIBS_COSERVER_VERSION_H
 
-#define METLIBS_COSERVER_VERSION_MAJOR 3
+#define METLIBS_COSERVER_VERSION_MAJOR 4
 #define METLIBS_COSERVER_VERSION_MINOR 0
-#define METLIBS_COSERVER_VERSION_PATCH 3
+#define METLIBS_COSERVER_VERSION_PATCH 0
 
 #define METLIBS_COSERVER_VERSION_INT(major,minor,patch) \
     (1000000*major + 1000*minor + patch)
@@ -3,6 +3,7 @@
 
 #include "miMessage.h"
 
+#include <QBuffer>
 #include <QDataStream>
 #include <QIODevice>
 
@@ -33,7 +34,9 @@ miMessageIO::miMessageIO(QIODevice* d, bool server)
     : mDevice(d)
     , mIsServer(server)
     , mReadBlockSize(0)
+    , mBytesRead(0)
     , mProtocolVersion(0)
+    , mBufferWrites(false)
 {
 }
 
@@ -68,6 +71,7 @@ bool miMessageIO::read(int& fromId, ClientIds& toIds, miQMessage& qmsg)
     } else {
         readV0(in, first, fromId, toIds, qmsg);
     }
+    mBytesRead += sizeof(mReadBlockSize) + mReadBlockSize;
     mReadBlockSize = 0;
     return true;
 }
@@ -76,8 +80,38 @@ void miMessageIO::write(int from, const ClientIds& toIds, const miQMessage& qmsg
 {
     METLIBS_LOG_SCOPE();
 
-    QByteArray block;
-    QDataStream out(&block, QIODevice::WriteOnly);
+    if (mBufferWrites) {
+        encode(mWriteBuffer, from, toIds, qmsg);
+    } else {
+        QByteArray block;
+        encode(block, from, toIds, qmsg);
+        mDevice->write(block);
+    }
+}
+
+bool miMessageIO::flush()
+{
+    METLIBS_LOG_SCOPE(LOGVAL(mWriteBuffer.size()));
+    if (mWriteBuffer.isEmpty())
+        return true;
+
+    const qint64 written = mDevice->write(mWriteBuffer);
+    const bool complete = (written == mWriteBuffer.size());
+    if (!complete)
+        METLIBS_LOG_ERROR("device accepted only " << written << " of " << mWriteBuffer.size() << " bytes");
+    mWriteBuffer.clear();
+    return complete;
+}
+
+void miMessageIO::encode(QByteArray& buffer, int from, const ClientIds& toIds, const miQMessage& qmsg)
+{
+    // append after any frames already in the buffer
+    const int start = buffer.size();
+    QBuffer device(&buffer);
+    device.open(QIODevice::WriteOnly);
+    device.seek(start);
+
+    QDataStream out(&device);
     out.setVersion(QDataStream::Qt_4_0);
     out << (quint32)0;
 
@@ -90,10 +124,8 @@ void miMessageIO::write(int from, const ClientIds& toIds, const miQMessage& qmsg
             writeV1(out, from, toIds, qmsg);
     }
 
-    out.device()->seek(0);
-    out << (quint32)(block.size() - sizeof(quint32)); // exclude 4 bytes with block size from length
-
-    mDevice->write(block);
+    out.device()->seek(start);
+    out << (quint32)(buffer.size() - start - sizeof(quint32)); // exclude 4 bytes with block size from length
 }
 
 void miMessageIO::writeV0(QDataStream& out, int from, const ClientIds& toIds, const miQMessage& qmsg)
@@ -3,6 +3,7 @@
 
 #include "miMessage.h"
 
+#include <QByteArray>
 #include <QtGlobal> // quint32
 
 class QIODevice;
@@ -16,6 +17,26 @@ public:
 
     void write(int from, const ClientIds& to, const miQMessage& qmsg);
 
+    /*! If enabled, write() only encodes messages into a buffer, which is
+     *  written to the device as one block by flush().
+     */
+    void setBufferWrites(bool bw)
+        { mBufferWrites = bw; }
+
+    //! return false if the device did not accept all buffered data
+    bool flush();
+
+    qint64 bytesBuffered() const
+        { return mWriteBuffer.size(); }
+
+    //! size of the message that is currently being received, or 0
+    quint32 pendingReadSize() const
+        { return mReadBlockSize; }
+
+    //! total number of bytes of completely received messages
+    quint64 bytesRead() const
+        { return mBytesRead; }
+
     int protocolVersion() const
         { return mProtocolVersion; }
 
@@ -23,6 +44,8 @@ public:
         { mProtocolVersion = pv; }
 
 private:
+    void encode(QByteArray& buffer, int from, const ClientIds& to, const miQMessage& qmsg);
+
     void writeV0(QDataStream& out, int from, const ClientIds& toIds, const miQMessage& qmsg);
     void readV0(QDataStream& in, int first, int& fromId, ClientIds& toIds, miQMessage& qmsg);
 
@@ -34,7 +57,11 @@ private:
     bool mIsServer;
 
     quint32 mReadBlockSize;
+    quint64 mBytesRead;
     int mProtocolVersion;
+
+    bool mBufferWrites;
+    QByteArray mWriteBuffer;
 };
 
 #endif // METLIBS_COSERVER_MESSAGEIO_H
@@ -0,0 +1,294 @@
+
+#include "CoClient.h"
+#include "miMessageIO.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QTemporaryDir>
+#include <QtNetwork/QLocalServer>
+#include <QtNetwork/QLocalSocket>
+
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <memory>
+
+namespace {
+
+const int WAIT_MS = 5000;
+const int CLIENT_ID = 1;
+const int PEER_ID = 2;
+
+void ensureApplication()
+{
+  static int argc = 1;
+  static char name[] = "coserver_test";
+  static char* argv[] = { name, 0 };
+  if (!QCoreApplication::instance())
+    new QCoreApplication(argc, argv);
+}
+
+//! Process events until done() or WAIT_MS have passed.
+bool waitFor(const std::function<bool()>& done)
+{
+  QElapsedTimer timer;
+  timer.start();
+  while (!done()) {
+    if (timer.elapsed() > WAIT_MS)
+      return false;
+    QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+  }
+  return true;
+}
+
+//! A server for one client, speaking the coserver protocol on a local socket.
+class FakeServer {
+public:
+  FakeServer()
+    : mSocket(0)
+    {
+      mServer.listen(mDir.path() + "/coserver");
+    }
+
+  QUrl url() const
+    {
+      QUrl u;
+      u.setScheme("local");
+      u.setPath(mServer.fullServerName());
+      return u;
+    }
+
+  bool waitForClient()
+    {
+      if (!waitFor([this]() { return mServer.hasPendingConnections(); }))
+        return false;
+      mSocket = mServer.nextPendingConnection();
+      mIO.reset(new miMessageIO(mSocket, true));
+      return true;
+    }
+
+  //! Read messages from the client until n with command have arrived.
+  bool waitForCommand(const QString& command, int n = 1)
+    {
+      return waitFor([this, command, n]() { readAll(); return count(command) >= n; });
+    }
+
+  int count(const QString& command) const
+    {
+      int n = 0;
+      for (int i=0; i<received.size(); ++i) {
+        if (received.at(i).command() == command)
+          n += 1;
+      }
+      return n;
+    }
+
+  int indexOf(const QString& command) const
+    {
+      for (int i=0; i<received.size(); ++i) {
+        if (received.at(i).command() == command)
+          return i;
+      }
+      return -1;
+    }
+
+  int lastIndexOf(const QString& command) const
+    {
+      for (int i=received.size()-1; i>=0; --i) {
+        if (received.at(i).command() == command)
+          return i;
+      }
+      return -1;
+    }
+
+  //! Assign the client its id and announce one connected peer.
+  void registerClient()
+    {
+      miQMessage registered("registeredclient");
+      registered.addCommon("id", QString::number(CLIENT_ID));
+      registered.addDataDesc("id").addDataDesc("type").addDataDesc("name");
+      registered.addDataValues(QStringList() << QString::number(PEER_ID) << "peer" << "peer");
+      send(0, registered);
+
+      miQMessage newclient("newclient");
+      newclient.addCommon("id", QString::number(PEER_ID));
+      newclient.addCommon("name", "peer");
+      send(0, newclient);
+    }
+
+  void send(int from, const miQMessage& qmsg)
+    {
+      mIO->write(from, ClientIds(), qmsg);
+      mSocket->flush();
+    }
+
+  QList<miQMessage> received;
+
+private:
+  void readAll()
+    {
+      int from;
+      ClientIds to;
+      miQMessage qmsg;
+      while (mIO && mIO->read(from, to, qmsg))
+        received << qmsg;
+    }
+
+private:
+  QTemporaryDir mDir;
+  QLocalServer mServer;
+  QLocalSocket* mSocket;
+  std::unique_ptr<miMessageIO> mIO;
+};
+
+class CoClientTest : public ::testing::Test {
+protected:
+  static void SetUpTestCase()
+    {
+      // the server socket in the fixture needs an event dispatcher
+      ensureApplication();
+    }
+
+  void SetUp()
+    {
+      qunsetenv("COSERVER_URLS");
+      qunsetenv("COSERVER_HOST");
+      client.reset(new CoClient("test", CoClient::QUrlList() << server.url()));
+      client->setAttemptToStartServer(false);
+    }
+
+  void TearDown()
+    {
+      client.reset();
+    }
+
+  //! Connect and register, with the server knowing one peer.
+  bool connectClient()
+    {
+      client->connectToServer();
+      if (!server.waitForClient() || !server.waitForCommand("SETTYPE"))
+        return false;
+      server.registerClient();
+      return waitFor([this]() { return client->getClientId() == CLIENT_ID
+                  && client->getClientIds().count(PEER_ID); });
+    }
+
+  FakeServer server;
+  std::unique_ptr<CoClient> client;
+};
+
+miQMessage reply(const miQMessage& request, const QString& value)
+{
+  miQMessage qmsg("info");
+  qmsg.addCommon("value", value);
+  const int idx = request.findCommonDesc(qmstrings::request_id);
+  if (idx >= 0)
+    qmsg.addCommon(qmstrings::request_id, request.getCommonValue(idx));
+  return qmsg;
+}
+
+} // namespace
+
+TEST_F(CoClientTest, RequestReplyById)
+{
+  ASSERT_TRUE(connectClient());
+
+  QStringList answers;
+  const CoClient::ReplyHandler handler = [&answers](bool ok, int from, const miQMessage& r) {
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(PEER_ID, from);
+    answers << r.getCommonValue("value");
+  };
+  miQMessage first("getinfo");
+  first.addCommon("what", "first");
+  miQMessage second("getinfo");
+  second.addCommon("what", "second");
+  EXPECT_NE(0u, client->request(first, PEER_ID, "info", handler));
+  EXPECT_NE(0u, client->request(second, PEER_ID, "info", handler));
+
+  ASSERT_TRUE(server.waitForCommand("getinfo", 2));
+  const miQMessage requestFirst = server.received.at(server.indexOf("getinfo"));
+  const miQMessage requestSecond = server.received.at(server.lastIndexOf("getinfo"));
+  ASSERT_GE(requestFirst.findCommonDesc(qmstrings::request_id), 0);
+  ASSERT_GE(requestSecond.findCommonDesc(qmstrings::request_id), 0);
+
+  // answered in reverse order, matched by request id
+  server.send(PEER_ID, reply(requestSecond, requestSecond.getCommonValue("what")));
+  server.send(PEER_ID, reply(requestFirst, requestFirst.getCommonValue("what")));
+  ASSERT_TRUE(waitFor([&answers]() { return answers.size() == 2; }));
+  EXPECT_EQ(QStringList() << "second" << "first", answers);
+}
+
+TEST_F(CoClientTest, RequestReplyWithoutId)
+{
+  ASSERT_TRUE(connectClient());
+
+  int delivered = 0;
+  QObject::connect(client.get(), static_cast<void (CoClient::*)(int, const miQMessage&)>(&CoClient::receivedMessage),
+      [&delivered](int, const miQMessage& qmsg) { if (qmsg.command() == "info") delivered += 1; });
+
+  QString answer;
+  client->request(miQMessage("getinfo"), PEER_ID, "info", [&answer](bool ok, int, const miQMessage& r) {
+      EXPECT_TRUE(ok);
+      answer = r.getCommonValue("value");
+    });
+  ASSERT_TRUE(server.waitForCommand("getinfo"));
+
+  // an old peer does not echo the request id; the reply is matched by command
+  server.send(PEER_ID, reply(miQMessage("getinfo"), "untagged"));
+  ASSERT_TRUE(waitFor([&answer]() { return !answer.isEmpty(); }));
+  EXPECT_EQ("untagged", answer);
+  ASSERT_TRUE(waitFor([&delivered]() { return delivered == 1; }));
+}
+
+TEST_F(CoClientTest, RequestTimeout)
+{
+  ASSERT_TRUE(connectClient());
+
+  int calls = 0;
+  bool answered = true;
+  client->request(miQMessage("getinfo"), PEER_ID, "info", [&](bool ok, int, const miQMessage&) {
+      calls += 1;
+      answered = ok;
+    }, 50);
+  ASSERT_TRUE(waitFor([&calls]() { return calls > 0; }));
+  EXPECT_EQ(1, calls);
+  EXPECT_FALSE(answered);
+}
+
+TEST_F(CoClientTest, SendConflation)
+{
+  ASSERT_TRUE(connectClient());
+  client->setSendConflation("position", "layer");
+
+  // all sent before the queue is written at the end of this event loop iteration
+  for (int i=0; i<3; ++i) {
+    miQMessage position("position");
+    position.addCommon("layer", "a").addCommon("step", QString::number(i));
+    client->sendMessage(position);
+  }
+  miQMessage other("position");
+  other.addCommon("layer", "b").addCommon("step", "9");
+  client->sendMessage(other);
+  client->sendMessage(miQMessage("done"));
+
+  ASSERT_TRUE(server.waitForCommand("done"));
+  ASSERT_EQ(2, server.count("position"));
+  const miQMessage& latest = server.received.at(server.indexOf("position"));
+  EXPECT_EQ("a", latest.getCommonValue("layer"));
+  EXPECT_EQ("2", latest.getCommonValue("step"));
+  EXPECT_EQ("b", server.received.at(server.lastIndexOf("position")).getCommonValue("layer"));
+  EXPECT_LT(server.indexOf("position"), server.indexOf("done"));
+}
+
+TEST_F(CoClientTest, OfflineBufferAfterSetType)
+{
+  client->setOfflineBuffer(10, 0);
+  EXPECT_TRUE(client->sendMessage(miQMessage("early")));
+
+  ASSERT_TRUE(connectClient());
+  ASSERT_TRUE(server.waitForCommand("early"));
+  EXPECT_EQ(0, server.indexOf("SETTYPE"));
+  // buffered messages wait for the peer list
+  EXPECT_LT(server.indexOf("SETPEERS"), server.indexOf("early"));
+}
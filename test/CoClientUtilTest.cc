@@ -0,0 +1,201 @@
+
+#include "CoClientUtil.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+miQMessage positions(const char* const rows[][2], int count)
+{
+  miQMessage qmsg("positions");
+  qmsg.addDataDesc("name").addDataDesc("lat").addDataDesc("lon");
+  for (int i=0; i<count; ++i)
+    qmsg.addDataValues(QStringList() << QString::number(i) << rows[i][0] << rows[i][1]);
+  return qmsg;
+}
+
+QList<QUrl> servers(int count)
+{
+  QList<QUrl> urls;
+  for (int i=0; i<count; ++i)
+    urls << QUrl(QString("co4://server%1.example.com:19444").arg(i));
+  return urls;
+}
+
+} // namespace
+
+TEST(RowGridTest, SelectBox)
+{
+  const char* const rows[][2] = {
+    { "59.9", "10.7" },  // Oslo
+    { "60.4", "5.3" },   // Bergen
+    { "69.6", "18.9" },  // Tromsø
+    { "63.4", "10.4" },  // Trondheim
+    { "59.95", "10.75" },
+  };
+  const coclient::RowGrid grid(positions(rows, 5), 1, 2);
+
+  const std::vector<int> south = grid.select(59, 61, 5, 11);
+  ASSERT_EQ(3u, south.size());
+  EXPECT_EQ(0, south[0]);
+  EXPECT_EQ(1, south[1]);
+  EXPECT_EQ(4, south[2]);
+
+  EXPECT_TRUE(grid.select(0, 10, 0, 10).empty());
+  EXPECT_EQ(5u, grid.select(-90, 90, -180, 180).size());
+}
+
+TEST(RowGridTest, BoundaryIncluded)
+{
+  const char* const rows[][2] = {
+    { "60", "10" },
+    { "61", "11" },
+  };
+  const coclient::RowGrid grid(positions(rows, 2), 1, 2);
+  EXPECT_EQ(2u, grid.select(60, 61, 10, 11).size());
+  EXPECT_EQ(1u, grid.select(60.5, 61, 10.5, 11).size());
+}
+
+TEST(RowGridTest, DateLine)
+{
+  const char* const rows[][2] = {
+    { "65", "179.5" },
+    { "65", "-179.5" },
+    { "65", "0" },
+  };
+  const coclient::RowGrid grid(positions(rows, 3), 1, 2);
+  const std::vector<int> selected = grid.select(60, 70, 170, -170);
+  ASSERT_EQ(2u, selected.size());
+  EXPECT_EQ(0, selected[0]);
+  EXPECT_EQ(1, selected[1]);
+}
+
+TEST(RowGridTest, KeepsRowsWithoutPosition)
+{
+  const char* const rows[][2] = {
+    { "", "" },
+    { "60", "10" },
+    { "x", "10" },
+  };
+  const coclient::RowGrid grid(positions(rows, 3), 1, 2);
+  const std::vector<int> selected = grid.select(0, 1, 0, 1);
+  ASSERT_EQ(2u, selected.size());
+  EXPECT_EQ(0, selected[0]);
+  EXPECT_EQ(2, selected[1]);
+}
+
+TEST(RowGridTest, MissingColumns)
+{
+  const char* const rows[][2] = {
+    { "60", "10" },
+  };
+  // column 5 does not exist, the row has no position
+  const coclient::RowGrid grid(positions(rows, 1), 1, 5);
+  EXPECT_EQ(1u, grid.select(0, 1, 0, 1).size());
+}
+
+TEST(BackoffTest, Growth)
+{
+  EXPECT_EQ(100, coclient::backoffDelay(0, 100, 1000, 60000, 2));
+  EXPECT_EQ(1000, coclient::backoffDelay(1, 100, 1000, 60000, 2));
+  EXPECT_EQ(2000, coclient::backoffDelay(2, 100, 1000, 60000, 2));
+  EXPECT_EQ(4000, coclient::backoffDelay(3, 100, 1000, 60000, 2));
+  EXPECT_EQ(32000, coclient::backoffDelay(6, 100, 1000, 60000, 2));
+}
+
+TEST(BackoffTest, Limit)
+{
+  EXPECT_EQ(60000, coclient::backoffDelay(7, 100, 1000, 60000, 2));
+  // must not overflow for many attempts
+  EXPECT_EQ(60000, coclient::backoffDelay(100000, 100, 1000, 60000, 2));
+  // without growth
+  EXPECT_EQ(1000, coclient::backoffDelay(50, 100, 1000, 60000, 1));
+}
+
+TEST(BackoffTest, Jitter)
+{
+  EXPECT_EQ(1000, coclient::jitteredDelay(1000, 0.5, 0));
+  EXPECT_EQ(500, coclient::jitteredDelay(1000, 0.5, 1));
+  EXPECT_EQ(750, coclient::jitteredDelay(1000, 0.5, 0.5));
+  EXPECT_EQ(1000, coclient::jitteredDelay(1000, 0, 1));
+  EXPECT_EQ(0, coclient::jitteredDelay(1000, 1, 1));
+}
+
+TEST(DuplicateFilterTest, Copies)
+{
+  coclient::DuplicateFilter filter(4);
+  EXPECT_FALSE(filter.isDuplicate("a", 1));
+  EXPECT_TRUE(filter.isDuplicate("a", 1));
+  EXPECT_FALSE(filter.isDuplicate("a", 3));
+  EXPECT_FALSE(filter.isDuplicate("a", 2)); // out of order
+  EXPECT_TRUE(filter.isDuplicate("a", 3));
+  EXPECT_FALSE(filter.isDuplicate("b", 1)); // other origin
+  EXPECT_EQ(2u, filter.countOrigins());
+}
+
+TEST(DuplicateFilterTest, Bounded)
+{
+  coclient::DuplicateFilter filter(4);
+  for (quint32 seq = 10; seq < 20; ++seq)
+    EXPECT_FALSE(filter.isDuplicate("a", seq));
+  EXPECT_TRUE(filter.isDuplicate("a", 19));
+  EXPECT_TRUE(filter.isDuplicate("a", 16)); // still kept
+  EXPECT_TRUE(filter.isDuplicate("a", 12)); // too old to tell
+  EXPECT_FALSE(filter.isDuplicate("a", 20));
+}
+
+TEST(DuplicateFilterTest, Forget)
+{
+  coclient::DuplicateFilter filter(4);
+  filter.isDuplicate("a", 1);
+  filter.isDuplicate("b", 1);
+  filter.forget("a");
+  EXPECT_EQ(1u, filter.countOrigins());
+  EXPECT_FALSE(filter.isDuplicate("a", 1));
+  EXPECT_TRUE(filter.isDuplicate("b", 1));
+
+  filter.clear();
+  EXPECT_EQ(0u, filter.countOrigins());
+  EXPECT_FALSE(filter.isDuplicate("b", 1));
+}
+
+TEST(RingOrderTest, Empty)
+{
+  EXPECT_TRUE(coclient::ringOrder(QList<QUrl>(), "user", 100).isEmpty());
+}
+
+TEST(RingOrderTest, Permutation)
+{
+  const QList<QUrl> urls = servers(5);
+  const QList<QUrl> ordered = coclient::ringOrder(urls, "user", 100);
+  ASSERT_EQ(urls.size(), ordered.size());
+  for (int i=0; i<urls.size(); ++i)
+    EXPECT_EQ(1, ordered.count(urls.at(i)));
+  EXPECT_EQ(ordered, coclient::ringOrder(urls, "user", 100));
+}
+
+TEST(RingOrderTest, Spread)
+{
+  const QList<QUrl> urls = servers(3);
+  QList<QUrl> first;
+  for (int k=0; k<100; ++k) {
+    const QUrl u = coclient::ringOrder(urls, QString("user%1").arg(k), 100).first();
+    if (!first.contains(u))
+      first << u;
+  }
+  EXPECT_EQ(urls.size(), first.size());
+}
+
+TEST(RingOrderTest, ServerRemoved)
+{
+  const QList<QUrl> urls = servers(4);
+  QList<QUrl> fewer = urls;
+  fewer.removeAt(2);
+  for (int k=0; k<100; ++k) {
+    const QString key = QString("user%1").arg(k);
+    // the others keep their order, only users of the removed server move
+    QList<QUrl> expected = coclient::ringOrder(urls, key, 100);
+    expected.removeAll(urls.at(2));
+    EXPECT_EQ(expected, coclient::ringOrder(fewer, key, 100));
+  }
+}
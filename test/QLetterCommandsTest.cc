@@ -0,0 +1,36 @@
+
+#include "QLetterCommands.h"
+
+#include <QtCore/QString>
+
+#include <gtest/gtest.h>
+
+TEST(QLetterCommandsTest, HashKnownValues)
+{
+  // FNV-1a 32 bit test vectors
+  EXPECT_EQ(0x811c9dc5u, qmstrings::command_hash(""));
+  EXPECT_EQ(0xe40c292cu, qmstrings::command_hash("a"));
+  EXPECT_EQ(0xbf9cf968u, qmstrings::command_hash("foobar"));
+}
+
+TEST(QLetterCommandsTest, HashIsConstexpr)
+{
+  static_assert(qmstrings::ids::maparea == qmstrings::command_hash("maparea"),
+      "command ids must be usable at compile time");
+  EXPECT_EQ(qmstrings::ids::registeredclient, qmstrings::command_hash(qmstrings::registeredclient));
+  EXPECT_EQ(qmstrings::ids::changeimageandtext, qmstrings::command_hash(qmstrings::changeimageandtext));
+}
+
+TEST(QLetterCommandsTest, HashQStringSameAsUtf8)
+{
+  const char* commands[] = { "", "settime", "getproj4maparea", "\xc3\xa6\xc3\xb8\xc3\xa5" };
+  for (const char* c : commands) {
+    EXPECT_EQ(qmstrings::command_hash(c), qmstrings::command_hash(QString::fromUtf8(c))) << c;
+  }
+}
+
+TEST(QLetterCommandsTest, HashDistinguishesCommands)
+{
+  EXPECT_NE(qmstrings::ids::newclient, qmstrings::ids::removeclient);
+  EXPECT_NE(qmstrings::ids::getmaparea, qmstrings::ids::maparea);
+}